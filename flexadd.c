@@ -9,10 +9,13 @@
 
 #define VERSION "1.0.5"
 
+#define DEFAULT_TAB_WIDTH 8
+
 #include "flexfs.h"
 
 // --- Global Data/State ---
-uint8_t    SIR_buffer[SECTOR_SIZE];
+FLEX_IMAGE disk;
+uint8_t   *SIR_buffer;
 uint16_t   track_count;
 uint8_t    sectors_per_track;
 uint8_t    dir_start_sector = 5;
@@ -59,55 +62,26 @@ void convert_filename(const char *linux_filename, char *flex_name, char *flex_ex
 }
 
 /**
- * @brief Reads a sector from the disk image.
- * @param disk_file File pointer to the disk image.
- * @param track Track number (0-255).
- * @param sector Sector number (1-255).
- * @param buffer Buffer to store 256 bytes of data.
- * @return 0 on success, -1 on failure.
- */
-int read_sector(FILE *disk_file, uint8_t track, uint8_t sector, uint8_t *buffer) {
-    long offset = (long)track * sectors_per_track * SECTOR_SIZE + (long)(sector - 1) * SECTOR_SIZE;
-    if (fseek(disk_file, offset, SEEK_SET) != 0) {
-        fprintf(stderr, "Error: Cannot seek to T%d S%d.\n", track, sector);
-        return -1;
-    }
-    if (fread(buffer, 1, SECTOR_SIZE, disk_file) != SECTOR_SIZE) {
-        fprintf(stderr, "Error: Cannot read T%d S%d.\n", track, sector);
-        return -1;
-    }
-    return 0;
-}
-
-/**
- * @brief Writes a sector to the disk image.
- * @param disk_file File pointer to the disk image.
+ * @brief Returns a sector of the mapped disk image.
  * @param track Track number (0-255).
  * @param sector Sector number (1-255).
- * @param buffer Buffer containing 256 bytes of data.
- * @return 0 on success, -1 on failure.
+ * @return Pointer to the 256 byte sector, NULL on failure.
  */
-int write_sector(FILE *disk_file, uint16_t track, uint8_t sector, const uint8_t *buffer) {
-    long offset = (long)track * sectors_per_track * SECTOR_SIZE + (long)(sector - 1) * SECTOR_SIZE;
-    if (fseek(disk_file, offset, SEEK_SET) != 0) {
-        fprintf(stderr, "Error: Cannot seek to write T%d S%d.\n", track, sector);
-        return -1;
+uint8_t *get_sector(uint8_t track, uint8_t sector) {
+    uint8_t *buffer = flex_image_sector(&disk, track, sector);
+    if (buffer == NULL) {
+        fprintf(stderr, "Error: Cannot access T%d S%d.\n", track, sector);
     }
-    if (fwrite(buffer, 1, SECTOR_SIZE, disk_file) != SECTOR_SIZE) {
-        fprintf(stderr, "Error: Cannot write T%d S%d.\n", track, sector);
-        return -1;
-    }
-    return 0;
+    return buffer;
 }
 
 /**
  * @brief Reads the SIR and sets global variables.
- * @param disk_file File pointer to the disk image.
  * @return 0 on success, -1 on failure.
  */
-int init_disk_info(FILE *disk_file) {
-    // Read SIR sector (Track 0, Sector 3)
-    if (read_sector(disk_file, 0, 3, SIR_buffer) != 0) {
+int init_disk_info(void) {
+    // SIR sector (Track 0, Sector 3)
+    if ((SIR_buffer = get_sector(0, 3)) == NULL) {
         fprintf(stderr, "Error: Failed to read SIR sector (T0 S3).\n");
         return -1;
     }
@@ -129,60 +103,75 @@ int init_disk_info(FILE *disk_file) {
 }
 
 /**
- * @brief Finds the first available free sector from the free chain.
- * @param disk_file File pointer to the disk image.
- * @param track Output: Track of the free sector.
- * @param sector Output: Sector of the free sector.
- * @return 0 on success, -1 if no free sectors found.
+ * @brief Reserves sectors from the head of the free chain.
+ * Walks the free chain once and records the first count sectors in order.
+ * The SIR is not touched, see commit_free_sectors().
+ * @param count Number of sectors to reserve.
+ * @param chain Output: count track/sector pairs.
+ * @param next_track Output: Track of the new head of the free chain.
+ * @param next_sector Output: Sector of the new head of the free chain.
+ * @return 0 on success, -1 if there are not enough free sectors.
  */
-int find_free_sector(FILE *disk_file, uint8_t *track, uint8_t *sector) {
+int reserve_free_sectors(uint16_t count, uint8_t (*chain)[2], uint8_t *next_track, uint8_t *next_sector) {
     SIR_struct *sir = (SIR_struct *)(SIR_buffer + SIR_OFFSET);
-    
-    int i = 0;
-    for( i = 0; i < SIR_SIZE; i++) {
-        fprintf(stderr, "%02x ", SIR_buffer[i+SIR_OFFSET]);
-    }
-    fprintf(stderr, "\n");
+    uint16_t free_sectors = (uint16_t)((sir->freeSectorsHi << 8) + (sir->freeSectorsLo));
+    uint8_t track  = sir->firstFreeTrack;
+    uint8_t sector = sir->firstFreeSector;
 
-    *track  = sir->firstFreeTrack;
-    *sector = sir->firstFreeSector;
-    
-    if (*track == 0 && *sector == 0) {
-        return -1; // No free sectors left
-    }
-    
-    // Read the current free sector to find the link to the next one
-    uint8_t sector_data[SECTOR_SIZE];
-    if (read_sector(disk_file, *track, *sector, sector_data) != 0) {
+    if (count > free_sectors) {
+        fprintf(stderr, "Error: Need %d sectors, only %d free.\n", count, free_sectors);
         return -1;
     }
-    
-    // The next free sector is stored in bytes 0 and 1
-    uint8_t next_track  = sector_data[0];
-    uint8_t next_sector = sector_data[1];
-    
+
+    for (uint16_t i = 0; i < count; i++) {
+        if (track == 0 && sector == 0) {
+            return -1; // Free chain ends early
+        }
+
+        // The next free sector is stored in bytes 0 and 1
+        uint8_t *sector_data = get_sector(track, sector);
+        if (sector_data == NULL) {
+            return -1;
+        }
+        chain[i][0] = track;
+        chain[i][1] = sector;
+        track  = sector_data[0];
+        sector = sector_data[1];
+    }
+
+    *next_track  = track;
+    *next_sector = sector;
+    return 0;
+}
+
+/**
+ * @brief Commits a reservation to the SIR in one update.
+ * @param count Number of sectors taken from the free chain.
+ * @param next_track Track of the new head of the free chain.
+ * @param next_sector Sector of the new head of the free chain.
+ */
+void commit_free_sectors(uint16_t count, uint8_t next_track, uint8_t next_sector) {
+    SIR_struct *sir = (SIR_struct *)(SIR_buffer + SIR_OFFSET);
+
     // Update SIR with the new head of the free chain
     sir->firstFreeTrack  = next_track;
     sir->firstFreeSector = next_sector;
+    if (next_track == 0 && next_sector == 0) {
+        sir->lastFreeTrack  = 0;
+        sir->lastFreeSector = 0;
+    }
 
     // Decrement free sector count
     uint16_t free_sectors = (uint16_t)((sir->freeSectorsHi << 8) + (sir->freeSectorsLo));
-    free_sectors--;
+    free_sectors -= count;
     sir->freeSectorsHi = (uint8_t)((free_sectors >> 8) & 0xFF);
     sir->freeSectorsLo = (uint8_t)(free_sectors & 0xFF);
-    
-    // Write the updated SIR back to the disk
-    if (write_sector(disk_file, 0, 3, SIR_buffer) != 0) {
-        fprintf(stderr, "Error: Failed to update SIR free chain info.\n");
-        return -1;
-    }
-    
-    return 0;
 }
 
 /**
  * @brief Writes the given file content to a chain of newly allocated sectors.
- * @param disk_file File pointer to the disk image.
+ * All sectors are reserved up front so each one is written exactly once with
+ * its forward link and logical record number already set.
  * @param source_file_content The file data buffer.
  * @param content_size Size of the file data.
  * @param is_text_file Flag indicating if text translation is needed.
@@ -191,109 +180,88 @@ int find_free_sector(FILE *disk_file, uint8_t *track, uint8_t *sector) {
  * @param sector_count Output: Total number of sectors used.
  * @return 0 on success, -1 on failure.
  */
-int write_file_data(FILE *disk_file, const uint8_t *source_file_content, long content_size, int is_text_file, uint8_t *start_track, uint8_t *start_sector, uint16_t *sector_count) {
+int write_file_data(const uint8_t *source_file_content, long content_size, int is_text_file, uint8_t *start_track, uint8_t *start_sector, uint16_t *sector_count) {
+    const long data_space = SECTOR_SIZE - 4;
     const uint8_t *current_data = source_file_content;
     long bytes_remaining = content_size;
-    *sector_count = 0;
-
-    uint8_t current_track, current_sector;
-    // Okay, this works by updating the previous sector's next_track, next_sector
-    // when the sector_count > 0
-    uint8_t prev_track = 0, prev_sector = 0;
-    
-    // Buffer for the sector being written
-    uint8_t sector_buffer[SECTOR_SIZE] = {0};
-
-    // Main loop: Write data sector by sector
-    while (bytes_remaining > 0 || *sector_count == 0) {
-        // 1. Allocate a free sector
-        if (find_free_sector(disk_file, &current_track, &current_sector) != 0) {
-            fprintf(stderr, "Error: Out of free disk sectors!\n");
-            // NOTE: In a real utility, rollback/cleanup logic would be needed here.
-            return -1;
-        }
+    uint8_t next_track, next_sector;
 
-    fprintf(stderr, "Current: T%d/S%d\n", current_track, current_sector);
-
-    end_track  = current_track;
-    end_sector = current_sector;
+    // N = ceil(size / 252), an empty file still gets one sector
+    long count = (content_size + data_space - 1) / data_space;
+    if (count == 0) {
+        count = 1;
+    }
+    if (count > 0xFFFF) {
+        fprintf(stderr, "Error: File is too large for a FLEX disk.\n");
+        return -1;
+    }
 
-    fprintf(stderr, "Current: T%d/S%d\n", end_track, end_sector);
+    uint8_t (*chain)[2] = malloc(count * sizeof(*chain));
+    if (!chain) {
+        perror("Error allocating memory for sector chain");
+        return -1;
+    }
 
-        if (*sector_count == 0) {
-            *start_track  = current_track;
-            *start_sector = current_sector;
-        }
+    // 1. Reserve every sector the file needs in one walk of the free chain
+    if (reserve_free_sectors((uint16_t)count, chain, &next_track, &next_sector) != 0) {
+        fprintf(stderr, "Error: Out of free disk sectors!\n");
+        free(chain);
+        return -1;
+    }
 
-        // 2. Link the previous sector to this new sector
-        if (*sector_count > 0) {
-            // Read previous sector to update its link field (Bytes 0-1)
-            uint8_t prev_sector_buffer[SECTOR_SIZE];
-            if (read_sector(disk_file, prev_track, prev_sector, prev_sector_buffer) != 0) return -1;
-            
-            prev_sector_buffer[0] = current_track;  // Link Track
-            prev_sector_buffer[1] = current_sector; // Link Sector
-            
-            // Write the updated previous sector back
-            if (write_sector(disk_file, prev_track, prev_sector, prev_sector_buffer) != 0) return -1;
+    // 2. Write each data sector once, forward link already set
+    for (long i = 0; i < count; i++) {
+        uint8_t *sector_buffer = get_sector(chain[i][0], chain[i][1]);
+        if (sector_buffer == NULL) {
+            free(chain);
+            return -1;
         }
 
-        // 3. Prepare data for the current sector
-        memset(sector_buffer, 0, SECTOR_SIZE);
-        
-        // Bytes 0-3 are reserved for Link and LRN (zeroed initially)
-        long data_space = SECTOR_SIZE - 4;
         long bytes_to_copy = (bytes_remaining > data_space) ? data_space : bytes_remaining;
 
-        // Copy data into bytes 4-255
+        // Bytes 0-1 link to the next sector, (0, 0) ends the file
+        sector_buffer[0] = (i + 1 < count) ? chain[i + 1][0] : 0;
+        sector_buffer[1] = (i + 1 < count) ? chain[i + 1][1] : 0;
+        // Bytes 2-3 are the logical record number, 1 based
+        sector_buffer[2] = (uint8_t)(((i + 1) >> 8) & 0xFF);
+        sector_buffer[3] = (uint8_t)((i + 1) & 0xFF);
+
+        // Copy data into bytes 4-255, zero the rest
         memcpy(sector_buffer + 4, current_data, bytes_to_copy);
-        
-        // 4. Update state and write current sector
+        memset(sector_buffer + 4 + bytes_to_copy, 0, data_space - bytes_to_copy);
+
         current_data    += bytes_to_copy;
         bytes_remaining -= bytes_to_copy;
-        (*sector_count)++;
-
-        // Check if this is the last sector of the file
-        if (bytes_remaining <= 0) {
-            // Set Link to 0, 0 in bytes 0-1 (already zeroed by memset)
-            // LRN (bytes 2-3) remains 0 by default.
-        } else {
-            // Placeholder: Link field will be updated in the NEXT loop iteration
-            //
-            sector_buffer[0] = 0;
-            sector_buffer[1] = 0;
-        }
-
-        // Write the current sector
-        if (write_sector(disk_file, current_track, current_sector, sector_buffer) != 0) return -1;
-        
-        // Update previous pointer for the next iteration
-        prev_track  = current_track;
-        prev_sector = current_sector;
-        
-        // Break if we finished writing an empty file (sector_count will be 1)
-        if (*sector_count > 0 && content_size == 0) break;
     }
 
+    // 3. Commit the SIR once
+    commit_free_sectors((uint16_t)count, next_track, next_sector);
+
+    *start_track  = chain[0][0];
+    *start_sector = chain[0][1];
+    end_track     = chain[count - 1][0];
+    end_sector    = chain[count - 1][1];
+    *sector_count = (uint16_t)count;
+
+    free(chain);
     return 0;
 }
 
 /**
  * @brief Finds the first available (zeroed) directory entry and updates it.
- * @param disk_file File pointer to the disk image.
  * @param entry The fully populated DIR_struct to write.
  * @return 0 on success, -1 on failure.
  */
-int write_directory_entry(FILE *disk_file, const DIR_struct *entry) {
+int write_directory_entry(const DIR_struct *entry) {
     uint8_t current_track  = 0;
     uint8_t current_sector = DIR_START_SECTOR;
-    uint8_t sector_buffer[SECTOR_SIZE];
+    uint8_t *sector_buffer;
     
     // Directory sectors start at T0, S5 and continue up to T0, S(sectors_per_track)
     // We assume the directory does not span multiple tracks for simplicity, as per flexdsk.c
 
     while (current_sector <= sectors_per_track) {
-        if (read_sector(disk_file, current_track, current_sector, sector_buffer) != 0) return -1;
+        if ((sector_buffer = get_sector(current_track, current_sector)) == NULL) return -1;
 
         // Check 10 directory entries in this sector
         for (int i = 0; i < DIR_ENTRIES_PER_SECTOR; i++) {
@@ -306,11 +274,6 @@ int write_directory_entry(FILE *disk_file, const DIR_struct *entry) {
                 // Found a free spot! Copy the new entry data.
                 memcpy(dir_ptr, entry, DIR_ENTRY_SIZE);
 
-                // Write the updated directory sector back to disk
-                if (write_sector(disk_file, current_track, current_sector, sector_buffer) != 0) {
-                    fprintf(stderr, "Error: Failed to write updated directory sector T%d S%d.\n", current_track, current_sector);
-                    return -1;
-                }
                 printf("Directory updated at T%d S%d, entry %d.\n", current_track, current_sector, i + 1);
                 return 0; // Success!
             }
@@ -326,22 +289,21 @@ int write_directory_entry(FILE *disk_file, const DIR_struct *entry) {
 
 /**
  * @brief Translates Linux text file content to FLEX format.
- * Currently only replaces LF ($0A) with CR ($0D). Tab compression is not implemented.
+ * Tabs are expanded to the tab stops, space runs become 0x09 and a count and
+ * LF, CR LF or a lone CR become CR ($0D). See flex_text_encode().
  * @param content_in Input buffer.
  * @param size_in Input size.
- * @param content_out Output buffer (must be large enough).
+ * @param content_out Output buffer (at least FLEX_TEXT_ENC_MAX(size_in) bytes).
+ * @param tabs Tab stop width.
  * @return Size of the translated content.
  */
-long translate_text_content(const uint8_t *content_in, long size_in, uint8_t *content_out) {
-    long size_out = 0;
-
-    for (long i = 0; i < size_in; i++) {
-        if (content_in[i] == '\n') { // Linux LF ($0A)
-            content_out[size_out++] = 0x0D; // FLEX CR ($0D)
-        } else if (content_in[i] != '\r') { // Ignore Windows/Mac CR ($0D) if present
-            content_out[size_out++] = content_in[i];
-        }
-    }
+long translate_text_content(const uint8_t *content_in, long size_in, uint8_t *content_out, int tabs) {
+    FLEX_TEXT text;
+    long size_out;
+
+    flex_text_encode_init(&text, tabs);
+    size_out  = flex_text_encode(&text, content_in, size_in, content_out);
+    size_out += flex_text_encode_end(&text, content_out + size_out);
     return size_out;
 }
 
@@ -354,7 +316,7 @@ int main(int argc, char *argv[]) {
     if (argc == 5 && strcmp(argv[2], "filename") == 0) {
         // flexadd disk.dsk filename <FLEXFILE.EXT> -> Use argv[3] for host file, argv[4] for flex name
         is_translation_mode = 1;
-    } else if (argc == 4) {
+    } else if (argc == 4 || (argc == 5 && strncmp(argv[4], "-t", 2) == 0)) {
         // flexadd disk.dsk Linux_filename FLEXFILE.EXT -> Use argv[2] for host file, argv[3] for flex name
         // NO, the usage is slightly ambiguous. I'll stick to a standard positional argument for now
         // and add the translation feature via a flag like -t later if required.
@@ -373,8 +335,9 @@ int main(int argc, char *argv[]) {
         
     } else {
         // Use a clearer usage message for the command-line arguments.
-        fprintf(stderr, "Usage: flexadd <disk_image_file> <host_file_path> <FLEX_FILENAME.EXT> [-t]\n");
-        fprintf(stderr, "  -t: Enable text translation (LF to CR, tab compression not implemented).\n");
+        fprintf(stderr, "Usage: flexadd <disk_image_file> <host_file_path> <FLEX_FILENAME.EXT> [-t[width]]\n");
+        fprintf(stderr, "  -t: Enable text translation (LF to CR, tabs expanded to every 'width'\n");
+        fprintf(stderr, "      columns (default %d), runs of spaces compressed).\n", DEFAULT_TAB_WIDTH);
         return 1;
     }
 
@@ -383,20 +346,28 @@ int main(int argc, char *argv[]) {
     const char *host_path     = argv[2];
     const char *flex_name_ext = argv[3];
 
-    int translate_mode = (argc > 4 && strcmp(argv[4], "-t") == 0);
+    int translate_mode = (argc > 4 && strncmp(argv[4], "-t", 2) == 0);
+    int tab_width = DEFAULT_TAB_WIDTH;
+
+    if (translate_mode && argv[4][2] != '\0') {
+        tab_width = atoi(argv[4] + 2);
+        if (tab_width < 1 || tab_width > 127) {
+            fprintf(stderr, "Error: Tab width must be 1-127.\n");
+            return 1;
+        }
+    }
 
 
     // --- 1. Open Files ---
-    FILE *disk_file = fopen(disk_path, "r+b"); // Read/Write binary
-    if (!disk_file) {
-        perror("Error opening disk image file");
+    if (flex_image_open(&disk, disk_path, FLEX_RDWR) != 0) { // Read/Write mapping
+        fprintf(stderr, "Error opening disk image file\n");
         return 1;
     }
 
     FILE *host_file = fopen(host_path, "rb"); // Read binary
     if (!host_file) {
         perror("Error opening host file");
-        fclose(disk_file);
+        flex_image_close(&disk);
         return 1;
     }
 
@@ -408,7 +379,7 @@ int main(int argc, char *argv[]) {
     uint8_t *raw_content = (uint8_t *)malloc(file_size + 1);
     if (!raw_content) {
         perror("Error allocating memory for file content");
-        fclose(disk_file);
+        flex_image_close(&disk);
         fclose(host_file);
         return 1;
     }
@@ -420,23 +391,23 @@ int main(int argc, char *argv[]) {
     long final_size = file_size;
 
     if (translate_mode) {
-        // Maximum size after translation is file_size (in the worst case, size_in == size_out)
-        translated_content = (uint8_t *)malloc(file_size + 1); 
+        // A tab can become a 2 byte space run, so allow for twice the size
+        translated_content = (uint8_t *)malloc(FLEX_TEXT_ENC_MAX(file_size));
         if (!translated_content) {
             perror("Error allocating memory for translation");
             free(raw_content);
-            fclose(disk_file);
+            flex_image_close(&disk);
             return 1;
         }
-        final_size = translate_text_content(raw_content, file_size, translated_content);
+        final_size = translate_text_content(raw_content, file_size, translated_content, tab_width);
         free(raw_content);
         raw_content = translated_content;
     }
 
     // --- 4. Initialize Disk Info ---
-    if (init_disk_info(disk_file) != 0) {
+    if (init_disk_info() != 0) {
         free(raw_content);
-        fclose(disk_file);
+        flex_image_close(&disk);
         return 1;
     }
 
@@ -449,11 +420,11 @@ int main(int argc, char *argv[]) {
     printf("Writing %ld bytes (%s) to disk...\n", final_size, translate_mode ? "translated text" : "binary");
 
     // We pass the final_size (which might be 0 for an empty file)
-    if (write_file_data(disk_file, raw_content, final_size, translate_mode, &start_track, &start_sector, &total_sectors) != 0) {
+    if (write_file_data(raw_content, final_size, translate_mode, &start_track, &start_sector, &total_sectors) != 0) {
         // Rollback is skipped for this example
         fprintf(stderr, "File addition failed during data write. Disk state may be corrupted.\n");
         free(raw_content);
-        fclose(disk_file);
+        flex_image_close(&disk);
         return 1;
     }
     
@@ -544,17 +515,17 @@ int main(int argc, char *argv[]) {
             new_dir_entry.dateYear);
 
     // --- 7. Write Directory Entry ---
-    if (write_directory_entry(disk_file, &new_dir_entry) != 0) {
+    if (write_directory_entry(&new_dir_entry) != 0) {
         fprintf(stderr, "Error: Failed to create directory entry.\n");
         // Data is written, but not accessible.
         free(raw_content);
-        fclose(disk_file);
+        flex_image_close(&disk);
         return 1;
     }
 
     // --- 8. Cleanup and Finalize ---
     free(raw_content);
-    fclose(disk_file);
+    flex_image_close(&disk);
     printf("✅ Success! File '%s' added to disk image '%s'.\n", flex_name_ext, disk_path);
 
     return 0;
@@ -2,8 +2,11 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <time.h> 
+#include <sys/mman.h>
 
 // --- Constants and Definitions ---
 #ifndef uint8_t
@@ -13,9 +16,9 @@ typedef unsigned char uint8_t;
 #define PROGRAM_VERSION     "1.0.15" // Version
 
 extern void print_usage(const char *prog_name);
-extern void write_sector(FILE *disk_file, uint16_t track, uint8_t sector, uint8_t next_track,
-                         uint8_t next_sector);
-extern void write_sir_sector(FILE *disk_file, const char *vol_name, uint16_t tracks,
+extern void write_sector(uint8_t *image, uint8_t sectors_per_track, uint16_t track, uint8_t sector,
+                         uint8_t next_track, uint8_t next_sector);
+extern void write_sir_sector(uint8_t *image, const char *vol_name, uint16_t tracks,
                              uint8_t sectors_per_track, uint16_t vol_number,
                              const struct tm *current_time);
 
@@ -66,10 +69,12 @@ void print_usage(const char *prog_name) {
     fprintf(stderr, "  -b <boot_loader_file>: Path to a file to load into T0, S1 and S2 (512 bytes).\n");
 }
 
-// Function to write a single sector of 256 bytes
-void write_sector(FILE *disk_file, uint16_t track, uint8_t sector, uint8_t next_track, uint8_t next_sector)
+// Function to write a single sector of 256 bytes. The image is mapped and
+// starts out all zero, so only the link bytes need to be stored
+void write_sector(uint8_t *image, uint8_t sectors_per_track, uint16_t track, uint8_t sector,
+                  uint8_t next_track, uint8_t next_sector)
 {
-    uint8_t sector_data[SECTOR_SIZE] = {0};
+    uint8_t *sector_data = image + ((long)track * sectors_per_track + sector - 1) * SECTOR_SIZE;
 
     // Bytes 0-1 Link to the next sector (Req 1.2)
     // Exclude special sectors T0, S1, S2, S3, S4 (Req 1.1)
@@ -77,8 +82,6 @@ void write_sector(FILE *disk_file, uint16_t track, uint8_t sector, uint8_t next_
         sector_data[0] = next_track;
         sector_data[1] = next_sector;
     }
-
-    fwrite(sector_data, 1, SECTOR_SIZE, disk_file);
 }
 
 /*
@@ -93,8 +96,8 @@ void printVolumeLabel(uint8_t *s){
 }
 
 // Function to write the System Information Record (SIR) sector (T0, S3)
-void write_sir_sector(FILE *disk_file, const char *vol_name, uint16_t tracks, uint8_t sectors_per_track, uint16_t vol_number, const struct tm *current_time) {
-    uint8_t sir_sector_data[SECTOR_SIZE] = {0};
+void write_sir_sector(uint8_t *image, const char *vol_name, uint16_t tracks, uint8_t sectors_per_track, uint16_t vol_number, const struct tm *current_time) {
+    uint8_t *sir_sector_data = image + 2 * SECTOR_SIZE;
     
     // Calculate free sectors and start/end of free chain
     int total_sectors      = (int)tracks * (int)sectors_per_track;
@@ -168,8 +171,6 @@ void write_sir_sector(FILE *disk_file, const char *vol_name, uint16_t tracks, ui
         fprintf(stderr, "%02x ", sir_sector_data[i+SIR_OFFSET]);
     }
     fprintf(stderr, "\n");
-    
-    fwrite(sir_sector_data, 1, SECTOR_SIZE, disk_file);
 }
 
 // Main function
@@ -263,12 +264,31 @@ int main(int argc, char *argv[]) {
     time(&timer);
     tm_info = localtime(&timer);
 
-    // --- 3. Open Disk Image File ---
-    FILE *disk_file = fopen(output_filename, "wb");
-    if (disk_file == NULL) {
+    // --- 3. Create Disk Image File ---
+    // The file is allocated at its full size, reading back as zeros, and
+    // mapped. Only the non-zero bytes (boot loader, SIR and sector links)
+    // are then stored, there is no sector by sector writing. The blocks
+    // are reserved up front so a full disk is reported here rather than
+    // as a SIGBUS while storing through the mapping
+    long image_size = (long)num_tracks * num_sectors * SECTOR_SIZE;
+    int disk_fd = open(output_filename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (disk_fd < 0) {
         perror("Error opening output disk file");
         return 1;
     }
+    int err = posix_fallocate(disk_fd, 0, image_size);
+    if (err != 0) {
+        errno = err;
+        perror("Error sizing output disk file");
+        close(disk_fd);
+        return 1;
+    }
+    uint8_t *image = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, disk_fd, 0);
+    if (image == MAP_FAILED) {
+        perror("Error mapping output disk file");
+        close(disk_fd);
+        return 1;
+    }
 
     printf("flexdsk version %s: Creating disk image '%s'...\n", PROGRAM_VERSION, output_filename);
 
@@ -277,41 +297,26 @@ int main(int argc, char *argv[]) {
     // T0, S1 & S2 (Boot Loader)
     if (boot_loader_file) {
         FILE *boot_file = fopen(boot_loader_file, "rb");
-        uint8_t boot_data[SECTOR_SIZE] = {0};
 
         if (boot_file) {
-            fread(boot_data, 1, SECTOR_SIZE, boot_file);
-            fwrite(boot_data, 1, SECTOR_SIZE, disk_file);
-            
-            memset(boot_data, 0, SECTOR_SIZE);
-            fread(boot_data, 1, SECTOR_SIZE, boot_file);
-            fwrite(boot_data, 1, SECTOR_SIZE, disk_file);
-            
+            fread(image, 1, 2 * SECTOR_SIZE, boot_file);
             fclose(boot_file);
         } else {
             fprintf(stderr, "Warning: Error opening boot loader file '%s'. Writing empty sectors for T0, S1 & S2.\n", boot_loader_file);
-            uint8_t empty_sector[SECTOR_SIZE] = {0};
-            fwrite(empty_sector, 1, SECTOR_SIZE, disk_file);
-            fwrite(empty_sector, 1, SECTOR_SIZE, disk_file);
         }
-    } else {
-        uint8_t empty_sector[SECTOR_SIZE] = {0};
-        fwrite(empty_sector, 1, SECTOR_SIZE, disk_file); // T0, S1
-        fwrite(empty_sector, 1, SECTOR_SIZE, disk_file); // T0, S2
     }
     
     fprintf(stderr, "NTracks: %d\n", num_tracks);
 
     // T0, S3 (SIR)
     // Note: The maximum track number is (num_tracks - 1), which fits in a uint8_t (0-255).
-    write_sir_sector(disk_file, vol_name_arg, (uint16_t)num_tracks, (uint8_t)num_sectors, (uint16_t)vol_number, tm_info);
+    write_sir_sector(image, vol_name_arg, (uint16_t)num_tracks, (uint8_t)num_sectors, (uint16_t)vol_number, tm_info);
 
-    // T0, S4 (Unused)
-    write_sector(disk_file, 0, 4, 0, 0); 
+    // T0, S4 (Unused) is left zeroed
     
-    // T0, S5 up to T0, Sn (Directory - zeroed)
+    // T0, S5 up to T0, Sn (Directory - zeroed), the last one ends the chain
     for (int s = 5; s <= num_sectors; ++s) {
-        write_sector(disk_file, 0, (uint8_t)s, 0, s+1);
+        write_sector(image, (uint8_t)num_sectors, 0, (uint8_t)s, 0, s < num_sectors ? s + 1 : 0);
     }
     
     // Remaining Free Chain Sectors (T1, S1 onwards)
@@ -333,12 +338,21 @@ int main(int argc, char *argv[]) {
                 next_sector = 0;
             }
             
-            write_sector(disk_file, (uint8_t)t, (uint8_t)s, next_track, next_sector);
+            write_sector(image, (uint8_t)num_sectors, (uint8_t)t, (uint8_t)s, next_track, next_sector);
         }
     }
     
     // 5. Cleanup
-    fclose(disk_file);
+    if (msync(image, image_size, MS_SYNC) != 0) {
+        perror("Error writing output disk file");
+        munmap(image, image_size);
+        close(disk_fd);
+        return 1;
+    }
+    if (munmap(image, image_size) != 0 || close(disk_fd) != 0) {
+        perror("Error writing output disk file");
+        return 1;
+    }
     
     // 6. Output Summary
     printf("✅ Success! Disk image details:\n");
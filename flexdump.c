@@ -5,62 +5,46 @@
 #include <stdint.h>
 #include <ctype.h>
 
+#include "flexfs.h"
+
 // Semantic Versioning
 #define VERSION "1.0.2"
 
-// --- Flex Disk Structures ---
+// --- Flex Disk Constants ---
 
 // SECTOR size is 256 bytes (4 bytes header + 252 bytes data)
-#define FLEX_SECTOR_SIZE 256
-// Assumed standard 18 sectors per track for Flex
+#define FLEX_SECTOR_SIZE SECTOR_SIZE
+// Assumed standard 18 sectors per track for Flex, when the SIR has none
 #define SECTORS_PER_TRACK 18
 #define DISK_BLOCK_SIZE FLEX_SECTOR_SIZE
 
-typedef struct{
-    uint8_t  next_track;      // Points to next track in the link (Offset +0)
-    uint8_t  next_sector;     // Points to next sector in the link (Offset +1)
-    uint16_t File_logical;    // (Offset +2, +3)
-    uint8_t  data[252];       // (Offset +4 to +255)
-} SECTOR;
-
-// SIR_struct and DIR_struct are included for context
-typedef struct{
-    uint8_t  volLabel[11];
-    uint16_t volNumber;
-    uint8_t  firstFreeTrack;
-    uint8_t  firstFreeSector;
-    uint8_t  lastFreeTrack;
-    uint8_t  lastFreeSector;
-    uint16_t freeSectors;
-    uint8_t  dateMonth;
-    uint8_t  dateDay;
-    uint8_t  dateYear;
-    uint8_t  endTrack;
-    uint8_t  endSector;
-} SIR_struct;
-
-typedef struct{
-    uint8_t  fileName[8];
-    uint8_t  fileExt[3];
-    uint16_t unused1;
-    uint8_t  startTrack;
-    uint8_t  startSector;
-    uint8_t  endTrack;
-    uint8_t  endSector;
-    uint16_t totalSectors;
-    uint8_t  randomFileFlag;
-    uint8_t  unused2;
-    uint8_t  dateMonth;
-    uint8_t  dateDay;
-    uint8_t  dateYear;
-} DIR_struct;
+// Dump lines, as drawn on screen and written by -d
+#define DUMP_LINE   76                  // "AAAAAA " + hex + " |" + ASCII + "|\n"
+#define DUMP_BUFFER (1 << 20)           // Output is written a megabyte at a time
 
 // --- Global Variables ---
-FILE *disk_file = NULL;
+FLEX_IMAGE disk = { .fd = -1 };    // Read only mapping of the image
 long file_size = 0;
+int sectors_per_track = SECTORS_PER_TRACK;  // From the SIR, as the links use it
 long current_offset = 0; // Current byte offset for display (must be aligned to DISK_BLOCK_SIZE)
 int rows, cols;
 
+// --- Search (/ and n/N) ---
+FLEX_SEARCH search;
+size_t search_index = 0;   // Match n/N step from
+
+// --- Sector owners and predecessors, for following chains ---
+FLEX_INDEX chain_index;     // Built once, the image is read only
+
+// --- Line formatting ---
+const char hex_digits[] = "0123456789ABCDEF";
+char hex_table[256][2];     // Byte values as lower case hex
+char ascii_table[256];      // Byte values as shown in the ASCII column
+
+// --- What the screen shows, so redraws only touch what changed ---
+long view_offset = -1;      // Sector on screen, -1 repaints everything
+char view_status[256];      // Status line as drawn
+
 // --- Function Prototypes ---
 void init_curses();
 void close_curses();
@@ -72,6 +56,14 @@ void goto_track_sector(int track, int sector);
 void update_status_line(const SECTOR *sector_data);
 long track_sector_to_offset(int track, int sector);
 void offset_to_track_sector(long offset, int *track_out, int *sector_out);
+void search_start(const char *pattern);
+void search_step(int dir);
+int  parse_track_sector(const char *text, int *track, int *sector, const char **end);
+int  dump_image(long first, long last);
+void init_dump_tables();
+void chain_step(int dir);
+void chain_start();
+void format_dump_line(char *p, long addr, const uint8_t *row, long n);
 
 // --- Core Logic ---
 
@@ -97,11 +89,11 @@ void close_curses() {
  * @brief Converts track and sector numbers to a file offset.
  */
 long track_sector_to_offset(int track, int sector) {
-    if (track < 0 || sector < 1 || sector > SECTORS_PER_TRACK) {
+    if (track < 0 || sector < 1 || sector > sectors_per_track) {
         return -1;
     }
-    // offset = (Track * SECTORS_PER_TRACK + (Sector - 1)) * FLEX_SECTOR_SIZE
-    return ((long)track * SECTORS_PER_TRACK + (sector - 1)) * FLEX_SECTOR_SIZE;
+    // offset = (Track * sectors_per_track + (Sector - 1)) * FLEX_SECTOR_SIZE
+    return ((long)track * sectors_per_track + (sector - 1)) * FLEX_SECTOR_SIZE;
 }
 
 /**
@@ -109,29 +101,34 @@ long track_sector_to_offset(int track, int sector) {
  */
 void offset_to_track_sector(long offset, int *track_out, int *sector_out) {
     long block_index = offset / FLEX_SECTOR_SIZE;
-    *track_out = (int)(block_index / SECTORS_PER_TRACK);
-    *sector_out = (int)(block_index % SECTORS_PER_TRACK) + 1; // 1-based sector
+    *track_out = (int)(block_index / sectors_per_track);
+    *sector_out = (int)(block_index % sectors_per_track) + 1; // 1-based sector
 }
 
 
 /**
  * @brief Draws the hex editor view based on the current_offset.
+ * The screen is not cleared, so curses only sends the cells that differ
+ * from the last sector shown, and nothing is redrawn if the sector is the
+ * same one.
  */
 void draw_hex_editor() {
-    clear();
-    // Use a temporary byte array to read the whole sector block (256 bytes)
-    // This allows us to treat the header fields (next_track, etc.)
+    // The whole sector block (256 bytes) straight from the mapping. This
+    // allows us to treat the header fields (next_track, etc.)
     // as part of the data block for display purposes.
-    uint8_t sector_block[DISK_BLOCK_SIZE];
-    SECTOR *current_sector_ptr = (SECTOR *)sector_block;
+    const uint8_t *sector_block = disk.base + current_offset;
+    const SECTOR *current_sector_ptr = (const SECTOR *)sector_block;
+    size_t bytes_read = DISK_BLOCK_SIZE;
 
-    // Read a full sector (256 bytes) starting at current_offset
-    fseek(disk_file, current_offset, SEEK_SET);
-    size_t bytes_read = fread(sector_block, 1, DISK_BLOCK_SIZE, disk_file);
+    if (current_offset + DISK_BLOCK_SIZE > file_size) {
+        bytes_read = file_size - current_offset;
+    }
 
     if (bytes_read != DISK_BLOCK_SIZE) {
+        clear();
         mvprintw(0, 0, "Error reading sector at offset %06lX. Read %zu/%d bytes.",
                  current_offset, bytes_read, DISK_BLOCK_SIZE);
+        view_offset = -1;
         update_status_line(NULL);
         refresh();
         return;
@@ -143,39 +140,22 @@ void draw_hex_editor() {
     int display_lines = (rows - 3 > max_data_lines) ? max_data_lines : rows - 3; // Leave space for header/footer
 
     // --- Header ---
-    mvprintw(0, 0, " Addr  00 01 02 03 04 05 06 07  08 09 0A 0B 0C 0D 0E 0F   0123456789ABCDEF");
-    mvprintw(1, 0, "------ ------------------------------------------------  ------------------");
+    if (view_offset < 0) {
+        clear();
+        view_status[0] = '\0';
+        mvprintw(0, 0, " Addr  00 01 02 03 04 05 06 07  08 09 0A 0B 0C 0D 0E 0F   0123456789ABCDEF");
+        mvprintw(1, 0, "------ ------------------------------------------------  ------------------");
+    }
 
     // --- Hex/ASCII Dump ---
-    for (int i = 0; i < display_lines; i++) {
-        long addr = current_offset + (i * 16);
-        int line_start_index = i * 16;
-        char hex_line[50] = {0}; // Enough space for 16 * 3 + 1 space + null
-        char ascii_line[17] = {0}; // 16 chars + null terminator
-        int hex_pos = 0;
-
-        // Iterate over 16 bytes for the current line
-        for (int j = 0; j < 16; j++) {
-            int data_index = line_start_index + j;
-
-            if (data_index < DISK_BLOCK_SIZE) {
-                // Hex part
-                hex_pos += sprintf(hex_line + hex_pos, "%02x%s",
-                                   sector_block[data_index], (j == 7) ? "  " : " ");
-
-                // ASCII part
-                char c = sector_block[data_index];
-                ascii_line[j] = isprint(c) ? c : '.';
-            } else {
-                // Should not happen if DISK_BLOCK_SIZE is 256 and i*16 < 256
-                hex_pos += sprintf(hex_line + hex_pos, "   ");
-                ascii_line[j] = ' ';
-            }
-        }
-        ascii_line[16] = '\0'; // Null-terminate ASCII string
+    if (view_offset != current_offset) {
+        for (int i = 0; i < display_lines; i++) {
+            char line[DUMP_LINE];
 
-        // Print the line
-        mvprintw(2 + i, 0, "%06lX %s |%s|", addr, hex_line, ascii_line);
+            format_dump_line(line, current_offset + i * 16, sector_block + i * 16, 16);
+            mvaddnstr(2 + i, 0, line, DUMP_LINE - 1);
+        }
+        view_offset = current_offset;
     }
 
     // --- Status Line ---
@@ -183,29 +163,42 @@ void draw_hex_editor() {
 
     // --- Command Prompt ---
     mvprintw(rows - 1, 0, "> ");
+    clrtoeol();
 
     move(rows - 1, 2); // Put cursor at the prompt
     refresh();
 }
 
 /**
- * @brief Updates the status line with track/sector info.
+ * @brief Updates the status line with track/sector info, if it changed.
  */
 void update_status_line(const SECTOR *sector_data) {
+    char status[sizeof(view_status)];
     int track, sector;
     offset_to_track_sector(current_offset, &track, &sector);
 
     if (sector_data) {
-        mvprintw(rows - 2, 0,
+        int n = snprintf(status, sizeof(status),
                  "Track %d Sector: %d Next_t: %d Next_s: %d (Offset: %06lX) | Version: %s",
                  track, sector,
                  sector_data->next_track, sector_data->next_sector,
                  current_offset, VERSION);
+        if (n > 0 && n < sizeof(status)) {
+            n += snprintf(status + n, sizeof(status) - n, " | Owner: %s", flex_index_owner(&chain_index, current_offset));
+        }
+        if (search.count && n > 0 && n < sizeof(status)) {
+            snprintf(status + n, sizeof(status) - n, " | Match %zu/%zu @%06zX",
+                     search_index + 1, search.count, search.match[search_index]);
+        }
     } else {
-        mvprintw(rows - 2, 0, "Track %d Sector: %d (Offset: %06lX) - Error Reading Data | Version: %s",
+        snprintf(status, sizeof(status), "Track %d Sector: %d (Offset: %06lX) - Error Reading Data | Version: %s",
                  track, sector, current_offset, VERSION);
     }
-    clrtoeol(); // Clear to end of line
+    if (strcmp(status, view_status) != 0) {
+        strcpy(view_status, status);
+        mvaddstr(rows - 2, 0, status);
+        clrtoeol(); // Clear to end of line
+    }
 }
 
 /**
@@ -234,9 +227,78 @@ void handle_command(const char *cmd) {
             clrtoeol();
             getch();
         }
+    } else if (cmd[0] == '/') {
+        search_start(cmd + 1);
     }
 }
 
+/**
+ * @brief Finds every match of a pattern in the image and shows the first
+ * one at or after the current sector.
+ */
+void search_start(const char *pattern) {
+    if (flex_search_parse(&search, pattern) != 0) {
+        mvprintw(rows - 1, 2, "Invalid pattern. Use: / 41 42 ?? 43 or /\"text?");
+        clrtoeol();
+        getch();
+        return;
+    }
+    if (flex_search_run(&search, disk.base, file_size) < 0) {
+        mvprintw(rows - 1, 2, "Out of memory searching.");
+        clrtoeol();
+        getch();
+        return;
+    }
+    if (search.count == 0) {
+        mvprintw(rows - 1, 2, "Pattern not found.");
+        clrtoeol();
+        getch();
+        return;
+    }
+    search_index = flex_search_seek(&search, current_offset, 0);
+    goto_offset(search.match[search_index]);
+}
+
+/**
+ * @brief Shows the next (dir 1) or previous (dir -1) match, wrapping
+ * around the image.
+ */
+void search_step(int dir) {
+    if (search.count == 0) {
+        beep();
+        return;
+    }
+    search_index = flex_search_seek(&search, search.match[search_index], dir);
+    goto_offset(search.match[search_index]);
+}
+
+/**
+ * @brief Follows the current sector's link forward (dir 1) or goes back
+ * to the sector that links to it (dir -1).
+ */
+void chain_step(int dir) {
+    long offset = flex_index_step(&chain_index, &disk, current_offset, dir);
+
+    if (offset < 0) {
+        beep();
+        return;
+    }
+    current_offset = offset;
+}
+
+/**
+ * @brief Goes to the first sector of the chain the current sector is on.
+ */
+void chain_start() {
+    long offset = flex_index_start(&chain_index, &disk, current_offset);
+
+    if (offset < 0) {
+        beep();
+        return;
+    }
+    current_offset = offset;
+}
+
 /**
  * @brief Pages down to the next sector.
  */
@@ -302,46 +364,205 @@ void display_help() {
     mvprintw(2, 0, "Navigation Keys:");
     mvprintw(3, 2, "Page Up/KEY_PPAGE: Go to previous sector");
     mvprintw(4, 2, "Page Down/KEY_NPAGE: Go to next sector");
+    mvprintw(5, 2, "> / <: Follow the sector link forward / back, ^: Go to the file start");
     mvprintw(6, 0, "Command Prompt (at '>'):");
     mvprintw(7, 2, "h - Display this help screen");
     mvprintw(8, 2, "q - Quit the program");
     // FIX: Line 319 was mvptintw, corrected to mvprintw
     mvprintw(9, 2, "g <offset> - Go to byte offset (e.g., 'g 1024' or 'g 0x400')");
     mvprintw(10, 2, "t <track> <sector> - Go to track and sector (e.g., 't 1 1')");
-    mvprintw(12, 0, "Press any key to return to the editor.");
+    mvprintw(11, 2, "/<pattern> - Search: hex bytes '/41 42 ?? 43' or text '/\"NAME?TXT'");
+    mvprintw(12, 2, "n / N - Go to the next / previous match");
+    mvprintw(14, 0, "Press any key to return to the editor.");
     refresh();
     getch(); // Wait for user input
+    view_offset = -1;
+}
+
+// --- Batch Dump (-d) ---
+
+/**
+ * @brief Fills in the lookup tables used by format_dump_line().
+ */
+void init_dump_tables() {
+    for (int i = 0; i < 256; i++) {
+        hex_table[i][0] = tolower(hex_digits[i >> 4]);
+        hex_table[i][1] = tolower(hex_digits[i & 15]);
+        ascii_table[i] = i < 0x80 && isprint(i) ? i : '.';
+    }
+}
+
+/**
+ * @brief Formats one 16 byte line, "AAAAAA xx .. xx  xx .. xx  |ASCII|\n",
+ * into the DUMP_LINE characters at p. Bytes past n are left blank.
+ */
+void format_dump_line(char *p, long addr, const uint8_t *row, long n) {
+    char *h = p + 7;                // Hex column, 49 characters
+    char *a = p + 58;               // ASCII column, between bars
+
+    for (int k = 5; k >= 0; k--, addr >>= 4) p[k] = hex_digits[addr & 15];
+    p[6] = ' ';
+    for (int j = 0; j < 16; j++) {
+        if (j < n) {
+            h[0] = hex_table[row[j]][0];
+            h[1] = hex_table[row[j]][1];
+            a[j] = ascii_table[row[j]];
+        } else {
+            h[0] = h[1] = a[j] = ' ';
+        }
+        h[2] = ' ';
+        h += 3;
+        if (j == 7) *h++ = ' ';
+    }
+    p[56] = ' ';
+    p[57] = '|';
+    p[74] = '|';
+    p[75] = '\n';
+}
+
+/**
+ * @brief Parses "track:sector", setting end just past it.
+ * @return 0 on success, -1 if text is not a track:sector pair.
+ */
+int parse_track_sector(const char *text, int *track, int *sector, const char **end) {
+    char *p;
+
+    *track = strtol(text, &p, 0);
+    if (p == text || *p != ':') return -1;
+    text = p + 1;
+    *sector = strtol(text, &p, 0);
+    if (p == text) return -1;
+    *end = p;
+    return 0;
+}
+
+/**
+ * @brief Streams a hex and ASCII dump of the sectors at byte offsets first
+ * to last (inclusive) to stdout, each headed by its track, sector and link.
+ * Lines are the same as the interactive view, built from lookup tables.
+ * @return 0 on success, -1 if stdout could not be written.
+ */
+int dump_image(long first, long last) {
+    char *buffer = malloc(DUMP_BUFFER);
+    size_t used = 0;
+    int failed = 0;
+
+    if (buffer == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (long offset = first; offset <= last; offset += FLEX_SECTOR_SIZE) {
+        const uint8_t *sector_block = disk.base + offset;
+        const SECTOR *sector_data = (const SECTOR *)sector_block;
+        long bytes = file_size - offset < FLEX_SECTOR_SIZE ? file_size - offset : FLEX_SECTOR_SIZE;
+        int track, sector;
+
+        // Room for a header and every line of the sector
+        if (used + 128 + (FLEX_SECTOR_SIZE / 16) * DUMP_LINE > DUMP_BUFFER) {
+            if (fwrite(buffer, 1, used, stdout) != used) {
+                failed = 1;
+                break;
+            }
+            used = 0;
+        }
+
+        offset_to_track_sector(offset, &track, &sector);
+        if (bytes >= 4) {
+            used += sprintf(buffer + used, "Track %d Sector: %d Next_t: %d Next_s: %d LRN: %d (Offset: %06lX)\n",
+                            track, sector, sector_data->next_track, sector_data->next_sector,
+                            (sector_data->File_logicalHi << 8) | sector_data->File_logicalLo, offset);
+        } else {
+            used += sprintf(buffer + used, "Track %d Sector: %d (Offset: %06lX)\n", track, sector, offset);
+        }
+
+        for (long line = 0; line < bytes; line += 16) {
+            format_dump_line(buffer + used, offset + line, sector_block + line, bytes - line);
+            used += DUMP_LINE;
+        }
+    }
+
+    if (!failed && used && fwrite(buffer, 1, used, stdout) != used) failed = 1;
+    free(buffer);
+    if (fflush(stdout) != 0 || failed) {
+        perror("stdout");
+        return -1;
+    }
+    return 0;
 }
 
 /**
  * @brief Main function.
  */
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
+    int batch = argc >= 3 && strcmp(argv[1], "-d") == 0;
+
+    if (!(argc == 2 && argv[1][0] != '-') && !(batch && argc <= 4)) {
         fprintf(stderr, "Usage: %s <disk_image_file>\n", argv[0]);
+        fprintf(stderr, "       %s -d <disk_image_file> [track:sector[-[track:sector]]]\n", argv[0]);
+        fprintf(stderr, "  -d: Dump the image (or the range of sectors) to stdout.\n");
         return 1;
     }
 
-    disk_file = fopen(argv[1], "rb");
-    if (!disk_file) {
-        perror("Could not open disk image file");
+    // Map the image read only (empty images are refused)
+    if (flex_image_open(&disk, argv[batch ? 2 : 1], FLEX_RDONLY) != 0) {
+        fprintf(stderr, "Could not open disk image file\n");
         return 1;
     }
+    file_size = disk.size;
+    if (disk.sectors > 0) {
+        sectors_per_track = disk.sectors;
+    } else {
+        flex_image_geometry(&disk, file_size / (sectors_per_track * FLEX_SECTOR_SIZE), sectors_per_track);
+    }
+    init_dump_tables();
+
+    if (batch) {
+        long first = 0, last = file_size - 1;
+
+        if (argc == 4) {
+            int track, sector, bad;
+            const char *p;
+
+            // A single sector, a sector to the end, or an inclusive range
+            bad = parse_track_sector(argv[3], &track, &sector, &p) != 0 ||
+                  (first = track_sector_to_offset(track, sector)) < 0;
+            last = first + FLEX_SECTOR_SIZE - 1;
+            if (!bad && *p == '-') {
+                if (*++p == '\0') {
+                    last = file_size - 1;
+                } else {
+                    bad = parse_track_sector(p, &track, &sector, &p) != 0 || *p ||
+                          (last = track_sector_to_offset(track, sector)) < 0;
+                    last += FLEX_SECTOR_SIZE - 1;
+                    // The end may not come before the start
+                    bad = bad || last < first;
+                }
+            } else if (!bad && *p) {
+                bad = 1;
+            }
+            if (bad) {
+                fprintf(stderr, "Invalid range '%s'. Use: track:sector[-[track:sector]]\n", argv[3]);
+                flex_image_close(&disk);
+                return 1;
+            }
+            if (last >= file_size) last = file_size - 1;
+        }
 
-    // Get file size
-    fseek(disk_file, 0, SEEK_END);
-    file_size = ftell(disk_file);
-    fseek(disk_file, 0, SEEK_SET);
-
-    if (file_size == 0) {
-        fprintf(stderr, "Disk image file is empty.\n");
-        fclose(disk_file);
-        return 1;
+        int ret = first < file_size && first <= last ? dump_image(first, last) : 0;
+        flex_image_close(&disk);
+        return ret ? 1 : 0;
     }
 
     // Ensure initial offset is sector-aligned
     current_offset = 0;
 
+    if (flex_index_build(&chain_index, &disk) != 0) {
+        fprintf(stderr, "Out of memory indexing the image\n");
+        flex_image_close(&disk);
+        return 1;
+    }
+
     init_curses();
 
     int ch;
@@ -362,8 +583,18 @@ int main(int argc, char *argv[]) {
             running = 0;
         } else if (ch == 'h') {
             display_help();
-        } else if (ch == 'g' || ch == 't') {
-            // Enter command mode for 'g' or 't'
+        } else if (ch == '>') {
+            chain_step(1);
+        } else if (ch == '<') {
+            chain_step(-1);
+        } else if (ch == '^') {
+            chain_start();
+        } else if (ch == 'n') {
+            search_step(1);
+        } else if (ch == 'N') {
+            search_step(-1);
+        } else if (ch == 'g' || ch == 't' || ch == '/') {
+            // Enter command mode for 'g', 't' or '/'
             echo(); // Enable echo for command input
             curs_set(1); // Show cursor
             mvprintw(rows - 1, 0, "> %c", ch);
@@ -383,7 +614,9 @@ int main(int argc, char *argv[]) {
     }
 
     close_curses();
-    fclose(disk_file);
+    flex_image_close(&disk);
+    flex_search_free(&search);
+    flex_index_free(&chain_index);
 
     return 0;
 }
@@ -2,11 +2,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdint.h>
 #include <ctype.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include "flexfs.h"
 
@@ -35,9 +40,58 @@ char *file_path     = NULL;
 int unsaved_changes = 0; 
 int rows, cols;
 
-// --- New Global Memory Buffer ---
+// --- Mapped disk image (private, copy-on-write until saved) ---
+FLEX_IMAGE disk = { .fd = -1 };
 uint8_t *disk_memory = NULL;
 
+// One bit per sector of disk_memory that differs from the saved file
+uint8_t *dirty_map   = NULL;
+#define DIRTY_MAP_BYTES ((file_size + SECTOR_SIZE - 1) / SECTOR_SIZE / 8 + 1)
+
+// --- Undo/redo journal ---
+// Records are packed into one fixed arena: a header (image offset, length),
+// the old bytes, the new bytes and a trailing record size so the journal
+// can be walked backwards. The oldest records are dropped when it fills.
+#define JOURNAL_MAX  (1L << 20)     // Bytes of edit history kept
+#define JOURNAL_HDR  (sizeof(uint32_t) + sizeof(uint16_t))
+#define JOURNAL_TRL  sizeof(uint16_t)
+
+uint8_t journal[JOURNAL_MAX];
+long    journal_top = 0;            // End of the records that can be undone
+long    journal_end = 0;            // End of the records that can be redone
+
+// Keystrokes in one sector collect here until the edit leaves the sector
+struct {
+    long    offset;                 // Sector offset, -1 when nothing is open
+    int     lo, hi;                 // Edited bytes within the sector, hi exclusive
+    uint8_t before[SECTOR_SIZE];
+    uint8_t after[SECTOR_SIZE];
+} journal_open = { .offset = -1 };
+
+// --- Search (/ and n/N) ---
+FLEX_SEARCH search;
+size_t search_index = 0;            // Match n/N step from
+int    search_stale = 0;            // The image was edited after the search ran
+
+// --- Sector owners and predecessors, for following chains ---
+FLEX_INDEX chain_index;
+int        index_stale = 1;         // Built on first use and after edits
+
+// --- Logical file view (f NAME.EXT) ---
+#define FILE_DATA   (SECTOR_SIZE - 4)   // Data bytes in each sector of a file
+
+int   file_view = 0;                // Showing a file's data instead of sectors
+char  file_view_name[13];
+long *file_chain = NULL;            // Image offset of each sector of the file
+long  file_chain_len = 0;
+long  file_offset = 0;              // Logical offset of the page shown
+
+// --- What the screen shows, so redraws only touch what changed ---
+uint8_t view_bytes[DISK_BLOCK_SIZE];  // Sector bytes behind the hex rows
+long    view_offset = -1;             // Their offset, -1 repaints everything
+size_t  view_len = 0;
+char    view_status[512];             // Status line as drawn
+
 // mode = 1 (View), mode = 0 (Edit)
 int mode = 1; 
 
@@ -54,6 +108,22 @@ long    track_sector_to_offset(int track, int sector);
 void    offset_to_track_sector(long offset, int *track_out, int *sector_out);
 int     edit_sector(uint8_t *sector_block);
 int     save_file(int save_as);
+void    mark_dirty(long offset);
+long    write_dirty_sectors(const char *path);
+void    journal_record(long sector_offset, int index, uint8_t before, uint8_t after);
+void    journal_close();
+int     journal_undo();
+int     journal_redo();
+void    search_start(const char *pattern);
+void    search_step(int dir);
+FLEX_INDEX *sector_index();
+void    chain_step(int dir);
+void    chain_start();
+int     open_file_view(const char *name);
+void    leave_file_view();
+uint8_t *view_byte(long i);
+long    view_length();
+int     write_image_copy(const char *path);
 int     prompt_save_on_exit();
 uint8_t hex_char_to_int(char c);
 void    page_down();
@@ -103,8 +173,113 @@ uint8_t hex_char_to_int(char c) {
     return 0;
 }
 
+/**
+ * @brief Marks the sector holding offset as changed since the last save.
+ */
+void mark_dirty(long offset) {
+    long block = offset / SECTOR_SIZE;
+    dirty_map[block / 8] |= 1 << (block % 8);
+    unsaved_changes = 1;
+    search_stale = 1;
+    index_stale = 1;
+}
+
+/**
+ * @brief Writes only the dirty sectors back into the file at path.
+ * Runs of consecutive dirty sectors go out in one pwrite().
+ * @return Number of sectors written, -1 on error.
+ */
+long write_dirty_sectors(const char *path) {
+    long blocks = (file_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    long written = 0;
+    int fd = open(path, O_WRONLY);
+
+    if (fd < 0) return -1;
+
+    for (long b = 0; b < blocks; ) {
+        if (!(dirty_map[b / 8] & (1 << (b % 8)))) {
+            b++;
+            continue;
+        }
+        long run = b;
+        while (run < blocks && (dirty_map[run / 8] & (1 << (run % 8)))) run++;
+
+        off_t start = (off_t)b * SECTOR_SIZE;
+        size_t len = (size_t)(run - b) * SECTOR_SIZE;
+        if (start + len > file_size) len = file_size - start;
+
+        while (len > 0) {
+            ssize_t n = pwrite(fd, disk_memory + start, len, start);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                close(fd);
+                return -1;
+            }
+            start += n;
+            len -= n;
+        }
+        written += run - b;
+        b = run;
+    }
+
+    if (close(fd) != 0) return -1;
+    return written;
+}
+
+/**
+ * @brief Writes the whole image to a temporary file next to path and
+ * renames it over path, so a failed Save As never leaves a partial file.
+ * @return 0 on success, -1 on error.
+ */
+int write_image_copy(const char *path) {
+    char tmp_path[PATH_MAX];
+    struct stat st;
+    mode_t mask;
+    int fd;
+
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.XXXXXX", path) >= sizeof(tmp_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((fd = mkstemp(tmp_path)) < 0) return -1;
+
+    // Keep the permissions of a file we replace, else honour the umask
+    if (stat(path, &st) == 0) {
+        fchmod(fd, st.st_mode & 07777);
+    } else {
+        mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+    }
+
+    for (long done = 0; done < file_size; ) {
+        ssize_t n = write(fd, disk_memory + done, file_size - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            goto fail;
+        }
+        done += n;
+    }
+    if (fsync(fd) != 0 || close(fd) != 0) {
+        fd = -1;
+        goto fail;
+    }
+    if (rename(tmp_path, path) != 0) {
+        fd = -1;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    if (fd >= 0) close(fd);
+    unlink(tmp_path);
+    return -1;
+}
+
 /**
  * @brief Saves the current disk image from memory to the specified path.
+ * A plain save writes just the sectors edited since the last save; Save As
+ * writes a complete copy.
  */
 int save_file(int save_as) {
     char new_path[256];
@@ -127,27 +302,30 @@ int save_file(int save_as) {
         target_path = new_path;
     }
 
-    FILE *out_file = fopen(target_path, "wb"); // Always use 'wb' or 'w+b' when writing the whole buffer
-    if (!out_file) {
-        mvprintw(rows - 1, 0, "Error: Could not open file for writing: %s", target_path);
+    if (target_path == file_path) {
+        long written = write_dirty_sectors(file_path);
+        if (written < 0) {
+            mvprintw(rows - 1, 0, "Error: Could not write %s: %s", file_path, strerror(errno));
+            clrtoeol();
+            return 0;
+        }
+        memset(dirty_map, 0, DIRTY_MAP_BYTES);
+        unsaved_changes = 0;
+        mvprintw(rows - 1, 0, "File saved successfully to: %s (%ld sectors)", file_path, written);
         clrtoeol();
-        return 0;
-    }
-    
-    // Update the file path if a 'Save As' was successful
-    if (target_path != file_path) {
-        if (file_path) free(file_path);
-        file_path = strdup(target_path);
+        return 1;
     }
-    
-    // Write the in-memory buffer to the file
-    size_t bytes_written = fwrite(disk_memory, 1, file_size, out_file);
 
-    if (bytes_written != file_size) {
-        mvprintw(rows - 1, 0, "Warning: Only wrote %zu of %ld bytes to %s", bytes_written, file_size, file_path);
+    if (write_image_copy(target_path) != 0) {
+        mvprintw(rows - 1, 0, "Error: Could not write %s: %s", target_path, strerror(errno));
+        clrtoeol();
+        return 0;
     }
 
-    fclose(out_file);
+    // The new file matches memory, so later saves only need the new edits
+    if (file_path) free(file_path);
+    file_path = strdup(target_path);
+    memset(dirty_map, 0, DIRTY_MAP_BYTES);
     unsaved_changes = 0;
     mvprintw(rows - 1, 0, "File saved successfully to: %s", file_path);
     clrtoeol();
@@ -182,6 +360,108 @@ int prompt_save_on_exit() {
     return 0; 
 }
 
+/**
+ * @brief Records one byte change, merging it into the open record when it
+ * falls in the same sector.
+ */
+void journal_record(long sector_offset, int index, uint8_t before, uint8_t after) {
+    if (journal_open.offset != sector_offset) {
+        journal_close();
+        journal_open.offset = sector_offset;
+        journal_open.lo = index;
+        journal_open.hi = index + 1;
+        journal_open.before[index] = before;
+    } else if (index < journal_open.lo || index >= journal_open.hi) {
+        // Bytes between the old range and this one are unchanged
+        int lo = index < journal_open.lo ? index : journal_open.lo;
+        int hi = index >= journal_open.hi ? index + 1 : journal_open.hi;
+        for (int i = lo; i < hi; i++) {
+            if (i < journal_open.lo || i >= journal_open.hi) {
+                journal_open.before[i] = journal_open.after[i] = disk_memory[sector_offset + i];
+            }
+        }
+        journal_open.lo = lo;
+        journal_open.hi = hi;
+        journal_open.before[index] = before;
+    }
+    journal_open.after[index] = after;
+}
+
+/**
+ * @brief Moves the open record into the journal, dropping any redo
+ * history and, if the arena is full, the oldest records.
+ */
+void journal_close() {
+    if (journal_open.offset < 0) return;
+
+    uint32_t offset = journal_open.offset + journal_open.lo;
+    uint16_t len = journal_open.hi - journal_open.lo;
+    uint16_t size = JOURNAL_HDR + 2 * len + JOURNAL_TRL;
+
+    journal_end = journal_top;
+    while (journal_top + size > JOURNAL_MAX) {
+        uint16_t old_len, old_size;
+        memcpy(&old_len, journal + sizeof(uint32_t), sizeof(old_len));
+        old_size = JOURNAL_HDR + 2 * old_len + JOURNAL_TRL;
+        memmove(journal, journal + old_size, journal_top - old_size);
+        journal_top -= old_size;
+    }
+
+    uint8_t *p = journal + journal_top;
+    memcpy(p, &offset, sizeof(offset));
+    memcpy(p + sizeof(offset), &len, sizeof(len));
+    memcpy(p + JOURNAL_HDR, journal_open.before + journal_open.lo, len);
+    memcpy(p + JOURNAL_HDR + len, journal_open.after + journal_open.lo, len);
+    memcpy(p + JOURNAL_HDR + 2 * len, &size, sizeof(size));
+    journal_top += size;
+    journal_end = journal_top;
+    journal_open.offset = -1;
+}
+
+/**
+ * @brief Restores the bytes of the last record and shows its sector.
+ * @return 1 if an edit was undone, 0 if there was nothing to undo.
+ */
+int journal_undo() {
+    uint32_t offset;
+    uint16_t len, size;
+
+    journal_close();
+    if (journal_top == 0) return 0;
+
+    memcpy(&size, journal + journal_top - JOURNAL_TRL, sizeof(size));
+    journal_top -= size;
+    memcpy(&offset, journal + journal_top, sizeof(offset));
+    memcpy(&len, journal + journal_top + sizeof(offset), sizeof(len));
+    memcpy(disk_memory + offset, journal + journal_top + JOURNAL_HDR, len);
+
+    mark_dirty(offset);
+    leave_file_view();
+    current_offset = (offset / SECTOR_SIZE) * SECTOR_SIZE;
+    return 1;
+}
+
+/**
+ * @brief Reapplies the last undone record and shows its sector.
+ * @return 1 if an edit was redone, 0 if there was nothing to redo.
+ */
+int journal_redo() {
+    uint32_t offset;
+    uint16_t len;
+
+    if (journal_top == journal_end) return 0;
+
+    memcpy(&offset, journal + journal_top, sizeof(offset));
+    memcpy(&len, journal + journal_top + sizeof(offset), sizeof(len));
+    memcpy(disk_memory + offset, journal + journal_top + JOURNAL_HDR + len, len);
+    journal_top += JOURNAL_HDR + 2 * len + JOURNAL_TRL;
+
+    mark_dirty(offset);
+    leave_file_view();
+    current_offset = (offset / SECTOR_SIZE) * SECTOR_SIZE;
+    return 1;
+}
+
 /**
  * @brief Enters the interactive sector editing mode, operating on disk_memory.
  */
@@ -192,9 +472,8 @@ int edit_sector(uint8_t *sector_block) {
     int cursor_field = HEX_FIELD;
     int cursor_sub_index = 0; 
 
-    // The sector data is a direct pointer into the global disk_memory buffer
-    uint8_t *editable_data = &disk_memory[current_offset];
-    size_t bytes_read = DISK_BLOCK_SIZE;
+    // The bytes on the page point straight into the global disk_memory buffer
+    size_t bytes_read = view_length();
 
     sw_mode(0); // Set mode to Edit (0)
     curs_set(1); 
@@ -221,6 +500,7 @@ int edit_sector(uint8_t *sector_block) {
         int ch = getch();
 
         if (ch == 27) { // ESCAPE: Exit edit mode
+            journal_close();
             sw_mode(1); // Set mode to View (1)
             curs_set(0);
             // The changes were already made directly to disk_memory, so we return 1 if anything was modified
@@ -239,11 +519,13 @@ int edit_sector(uint8_t *sector_block) {
         } else if (ch == KEY_DOWN) {
             cursor_byte_index = (cursor_byte_index + BYTES_PER_LINE) % bytes_read; 
         } else if (cursor_byte_index < bytes_read) { 
-            uint8_t *byte_to_edit = &editable_data[cursor_byte_index];
+            uint8_t *byte_to_edit = view_byte(cursor_byte_index);
+            uint8_t old_byte = *byte_to_edit;
+            long edit_offset = byte_to_edit - disk_memory;
             
             if (cursor_field == HEX_FIELD && isxdigit(ch)) {
                 modified = 1;
-                unsaved_changes = 1;
+                mark_dirty(edit_offset);
                 
                 uint8_t val = hex_char_to_int(ch);
                 
@@ -255,6 +537,7 @@ int edit_sector(uint8_t *sector_block) {
                     cursor_sub_index = 0;
                     cursor_byte_index = (cursor_byte_index + 1) % bytes_read; 
                 }
+                journal_record(edit_offset / SECTOR_SIZE * SECTOR_SIZE, edit_offset % SECTOR_SIZE, old_byte, *byte_to_edit);
                 
                 // --- LIVE UPDATE: Update Hex and ASCII at once ---
                 int hex_x_start = 7 + (byte_on_line * 3) + (byte_on_line >= 8 ? 1 : 0);
@@ -267,10 +550,11 @@ int edit_sector(uint8_t *sector_block) {
                 
             } else if (cursor_field == ASCII_FIELD && isprint(ch)) {
                 modified = 1;
-                unsaved_changes = 1;
+                mark_dirty(edit_offset);
                 
                 *byte_to_edit = (uint8_t)ch;
                 cursor_byte_index = (cursor_byte_index + 1) % bytes_read; 
+                journal_record(edit_offset / SECTOR_SIZE * SECTOR_SIZE, edit_offset % SECTOR_SIZE, old_byte, *byte_to_edit);
                 
                 // --- LIVE UPDATE: Update Hex and ASCII at once ---
                 int hex_x_start = 7 + (byte_on_line * 3) + (byte_on_line >= 8 ? 1 : 0);
@@ -285,24 +569,185 @@ int edit_sector(uint8_t *sector_block) {
     }
 }
 
+/**
+ * @brief Finds every match of a pattern in the image and shows the first
+ * one at or after the current sector.
+ */
+void search_start(const char *pattern) {
+    if (flex_search_parse(&search, pattern) != 0) {
+        mvprintw(rows - 1, 2, "Invalid pattern. Use: / 41 42 ?? 43 or /\"text?");
+        clrtoeol();
+        getch();
+        return;
+    }
+    if (flex_search_run(&search, disk_memory, file_size) < 0) {
+        mvprintw(rows - 1, 2, "Out of memory searching.");
+        clrtoeol();
+        getch();
+        return;
+    }
+    search_stale = 0;
+    if (search.count == 0) {
+        mvprintw(rows - 1, 2, "Pattern not found.");
+        clrtoeol();
+        getch();
+        return;
+    }
+    search_index = flex_search_seek(&search, current_offset, 0);
+    leave_file_view();
+    goto_offset(search.match[search_index]);
+}
+
+/**
+ * @brief Shows the next (dir 1) or previous (dir -1) match, wrapping
+ * around the image. The matches are found again only after an edit.
+ */
+void search_step(int dir) {
+    if (search.len == 0) {
+        beep();
+        return;
+    }
+    if (search_stale) {
+        size_t from = search.count ? search.match[search_index] : current_offset;
+        if (flex_search_run(&search, disk_memory, file_size) < 0) search.count = 0;
+        search_stale = 0;
+        if (search.count == 0) {
+            beep();
+            return;
+        }
+        // First match past the old one, or the last one before it
+        search_index = flex_search_seek(&search, from, dir);
+    } else {
+        if (search.count == 0) {
+            beep();
+            return;
+        }
+        search_index = flex_search_seek(&search, search.match[search_index], dir);
+    }
+    leave_file_view();
+    goto_offset(search.match[search_index]);
+}
+
+/**
+ * @brief Returns the sector index, building it again if the image was
+ * edited since it was last built. NULL if it could not be built.
+ */
+FLEX_INDEX *sector_index() {
+    if (index_stale) {
+        flex_index_free(&chain_index);
+        if (flex_index_build(&chain_index, &disk) != 0) return NULL;
+        index_stale = 0;
+    }
+    return &chain_index;
+}
+
+/**
+ * @brief Follows the current sector's link forward (dir 1) or goes back
+ * to the sector that links to it (dir -1).
+ */
+void chain_step(int dir) {
+    long offset = flex_index_step(sector_index(), &disk, current_offset, dir);
+
+    if (offset < 0) {
+        beep();
+        return;
+    }
+    leave_file_view();
+    current_offset = offset;
+}
+
+/**
+ * @brief Goes to the first sector of the chain the current sector is on.
+ */
+void chain_start() {
+    long offset = flex_index_start(sector_index(), &disk, current_offset);
+
+    if (offset < 0) {
+        beep();
+        return;
+    }
+    leave_file_view();
+    current_offset = offset;
+}
+
+/**
+ * @brief Shows a file as one stream of its data bytes (4-255 of each
+ * sector). The chain is walked once into file_chain, so any logical
+ * offset maps to its sector by a division.
+ * @return 0 on success, -1 if there is no such file or it is empty.
+ */
+int open_file_view(const char *name) {
+    FLEX_INDEX *x = sector_index();
+    long offset;
+    int f;
+
+    if (x == NULL) return -1;
+    for (f = 0; f < x->nfiles; f++) {
+        if (strcasecmp(x->files[f].name, name) == 0) break;
+    }
+    if (f == x->nfiles) return -1;
+
+    long *chain = realloc(file_chain, x->count * sizeof(long));
+    if (chain == NULL) return -1;
+    file_chain = chain;
+    file_chain_len = 0;
+
+    // Stop at the end of the chain, off the disk, or once it must loop
+    offset = flex_image_offset(&disk, x->files[f].track, x->files[f].sector);
+    while (offset >= 0 && file_chain_len < x->count) {
+        uint8_t *link = disk_memory + offset;
+        file_chain[file_chain_len++] = offset;
+        if (link[0] == 0 && link[1] == 0) break;
+        offset = flex_image_offset(&disk, link[0], link[1]);
+    }
+    if (file_chain_len == 0) return -1;
+
+    strcpy(file_view_name, x->files[f].name);
+    file_view = 1;
+    file_offset = 0;
+    current_offset = file_chain[0];
+    view_offset = -1;
+    return 0;
+}
+
+/**
+ * @brief Goes back to showing sectors, at the sector the file view was on.
+ */
+void leave_file_view() {
+    if (!file_view) return;
+    file_view = 0;
+    view_offset = -1;
+}
+
+/**
+ * @brief Returns the byte of the image shown at position i of the page,
+ * NULL past the end of the image or file.
+ */
+uint8_t *view_byte(long i) {
+    if (file_view) {
+        long logical = file_offset + i;
+        long k = logical / FILE_DATA;
+        if (k >= file_chain_len) return NULL;
+        return disk_memory + file_chain[k] + 4 + logical % FILE_DATA;
+    }
+    if (current_offset + i >= file_size) return NULL;
+    return disk_memory + current_offset + i;
+}
+
+/**
+ * @brief Returns the number of bytes on the page shown.
+ */
+long view_length() {
+    long end = file_view ? file_chain_len * FILE_DATA - file_offset : file_size - current_offset;
+    return end < DISK_BLOCK_SIZE ? end : DISK_BLOCK_SIZE;
+}
+
 /**
  * @brief Converts track and sector numbers to a file offset.
  */
 long track_sector_to_offset(int track, int sector)
 {
-    // @FIXME: Off by 1 sector/per track
-    // So
-    // 0 at 0
-    // 1 at 1
-    // ...
-    // FE at FE
-    // @FIXME: fixed track but sector is now wrong
-    if (track < 0 || track > (MAX_TRACKS-1) || sector < 1 || sector > MAX_SECTORS+1) {
-        return -1;
-    }
-    //return ((long)(track * SECTORS_PER_TRACK + (sector - 1)) * SECTOR_SIZE);
-    //return (long) (track + 1) * (sector * SECTOR_SIZE) - SECTOR_SIZE);
-    return (long) ((track + 1) * ((sector) * SECTOR_SIZE));
+    return flex_image_offset(&disk, track, sector);
 }
 
 /**
@@ -321,6 +766,7 @@ void goto_track_sector(int track, int sector) {
     long new_offset = track_sector_to_offset(track, sector); // & 0xFFFF00L;
 
     if (new_offset >= 0 && new_offset < file_size) {
+        leave_file_view();
         current_offset = new_offset;
     } else {
         mvprintw(rows - 1, 2, "Invalid Track/Sector location: T%d S%d (0x%x/0x%x)", track, sector, new_offset, file_size);
@@ -336,6 +782,16 @@ void goto_offset(long offset) {
     long new_offset = offset;
     new_offset = (new_offset / SECTOR_SIZE) * SECTOR_SIZE;
 
+    // In the file view offsets are into the file
+    if (file_view) {
+        long file_len = file_chain_len * FILE_DATA;
+        if (new_offset < 0) new_offset = 0;
+        if (new_offset >= file_len) new_offset = ((file_len - 1) / SECTOR_SIZE) * SECTOR_SIZE;
+        file_offset = new_offset;
+        current_offset = file_chain[file_offset / FILE_DATA];
+        return;
+    }
+
     if (new_offset < 0) new_offset = 0;
     if (new_offset >= file_size) {
         new_offset = file_size - SECTOR_SIZE;
@@ -349,6 +805,10 @@ void goto_offset(long offset) {
  * @brief Pages down to the next sector.
  */
 void page_down() {
+    if (file_view) {
+        goto_offset(file_offset + SECTOR_SIZE);
+        return;
+    }
     long new_offset = current_offset + SECTOR_SIZE;
     if (new_offset < file_size) {
         current_offset = new_offset;
@@ -362,6 +822,10 @@ void page_down() {
  * @brief Pages up to the previous sector.
  */
 void page_up() {
+    if (file_view) {
+        goto_offset(file_offset - SECTOR_SIZE);
+        return;
+    }
     current_offset -= SECTOR_SIZE;
     if (current_offset < 0) {
         current_offset = 0;
@@ -370,18 +834,33 @@ void page_up() {
 
 /**
  * @brief Draws the hex editor view based on the current_offset, reading from disk_memory.
+ * Only rows whose bytes differ from what is on screen are formatted again,
+ * and the screen is not cleared, so curses sends just the changed cells.
  */
 void draw_hex_editor() {
-    clear();
     // Use the pointer directly into the memory buffer for the current sector
     uint8_t *sector_block = &disk_memory[current_offset];
     SECTOR *current_sector_ptr = (SECTOR *)sector_block;
     size_t bytes_read = DISK_BLOCK_SIZE;
+    uint8_t file_page[DISK_BLOCK_SIZE];
+    long shown = file_view ? file_offset : current_offset;
+
+    if (view_offset < 0) {
+        clear();
+        view_status[0] = '\0';
+    }
+
+    // The file view gathers the page from the data bytes of its sectors
+    if (file_view) {
+        bytes_read = view_length();
+        for (int i = 0; i < bytes_read; i++) file_page[i] = *view_byte(i);
+        sector_block = file_page;
+    }
 
     // We assume the file is a multiple of SECTOR_SIZE. 
     // If not, we should calculate the actual remaining bytes, but 
     // for a disk editor, assuming fixed sector size is typical.
-    if (current_offset + bytes_read > file_size) {
+    if (!file_view && current_offset + bytes_read > file_size) {
          // Adjust bytes_read for the last partial sector
          bytes_read = file_size - current_offset; 
          if (bytes_read == 0 && file_size > 0) { // If we scrolled past the end
@@ -399,19 +878,31 @@ void draw_hex_editor() {
 
     int max_data_lines = DISK_BLOCK_SIZE / BYTES_PER_LINE;
     int display_lines = (rows - 3 > max_data_lines) ? max_data_lines : rows - 3;
+    int same_sector = (view_offset == shown && view_len == bytes_read);
 
     // --- Header ---
-    mvprintw(0, 0, " Addr  00 01 02 03 04 05 06 07  08 09 0A 0B 0C 0D 0E 0F   0123456789ABCDEF");
-    mvprintw(1, 0, "------ ------------------------------------------------  ------------------");
+    if (view_offset < 0) {
+        mvprintw(0, 0, " Addr  00 01 02 03 04 05 06 07  08 09 0A 0B 0C 0D 0E 0F   0123456789ABCDEF");
+        mvprintw(1, 0, "------ ------------------------------------------------  ------------------");
+    }
 
     // --- Hex/ASCII Dump ---
     for (int i = 0; i < display_lines; i++) {
-        long addr = current_offset + (i * BYTES_PER_LINE);
+        long addr = shown + (i * BYTES_PER_LINE);
         int line_start_index = i * BYTES_PER_LINE;
         char hex_line[50] = {0x20};
         char ascii_line[17] = {0x20};
         int hex_pos = 0;
 
+        // Rows already on screen are left alone
+        if (same_sector) {
+            size_t row_len = line_start_index < bytes_read ? bytes_read - line_start_index : 0;
+            if (row_len > BYTES_PER_LINE) row_len = BYTES_PER_LINE;
+            if (memcmp(view_bytes + line_start_index, sector_block + line_start_index, row_len) == 0) {
+                continue;
+            }
+        }
+
         for (int j = 0; j < BYTES_PER_LINE; j++) {
             int data_index = line_start_index + j;
 
@@ -434,11 +925,16 @@ void draw_hex_editor() {
         // Here's wher we actually print the line
         mvprintw(2 + i, 0, "%06lX %s |%s|", addr, hex_line, ascii_line);
     }
+    memcpy(view_bytes, sector_block, bytes_read);
+    view_offset = shown;
+    view_len = bytes_read;
 
     // --- Status Line ---
     update_status_line(current_sector_ptr);
 
     // --- Command Prompt ---
+    move(rows - 1, 0);
+    clrtoeol();
     sw_mode((-1));
 
     move(rows - 1, 6); 
@@ -446,27 +942,45 @@ void draw_hex_editor() {
 }
 
 /**
- * @brief Updates the status line with track/sector info.
+ * @brief Updates the status line with track/sector info, if it changed.
  */
 void update_status_line(const SECTOR *sector_data) {
+    char status[sizeof(view_status)];
     int track, sector;
     offset_to_track_sector(current_offset, &track, &sector);
 
     //const char *modified_status = unsaved_changes ? " [MODIFIED]" : "";
     const char *modified_status = unsaved_changes ? "*" : " ";
     
-    if (sector_data) {
-        mvprintw(rows - 2, 0,
-                 "Track %d Sector: %d Next_t: %d Next_s: %d (Offset: %06lX) | File: %s%s(%d/%d) | Version: %s",
+    if (sector_data && file_view) {
+        snprintf(status, sizeof(status),
+                 "Track %d Sector: %d Next_t: %d Next_s: %d (%s Offset: %06lX of %06lX) | File: %s%s(%d/%d) | Version: %s",
+                 track, sector,
+                 sector_data->next_track, sector_data->next_sector,
+                 file_view_name, file_offset, file_chain_len * FILE_DATA,
+                 file_path ? file_path : "[New File]", modified_status,
+                 tracks_per_disk, sectors_per_track, VERSION);
+    } else if (sector_data) {
+        int n = snprintf(status, sizeof(status),
+                 "Track %d Sector: %d Next_t: %d Next_s: %d (Offset: %06lX) | Owner: %s | File: %s%s(%d/%d) | Version: %s",
                  track, sector,
                  sector_data->next_track, sector_data->next_sector,
-                 current_offset, file_path ? file_path : "[New File]", modified_status,
+                 current_offset, flex_index_owner(sector_index(), current_offset),
+                 file_path ? file_path : "[New File]", modified_status,
                  tracks_per_disk, sectors_per_track, VERSION);
+        if (search.count && !search_stale && n > 0 && n < sizeof(status)) {
+            snprintf(status + n, sizeof(status) - n, " | Match %zu/%zu @%06zX",
+                     search_index + 1, search.count, search.match[search_index]);
+        }
     } else {
-        mvprintw(rows - 2, 0, "Track %d Sector: %d (Offset: %06lX) - Error Reading Data | Version: %s",
+        snprintf(status, sizeof(status), "Track %d Sector: %d (Offset: %06lX) - Error Reading Data | Version: %s",
                  track, sector, current_offset, VERSION);
     }
-    clrtoeol(); 
+    if (strcmp(status, view_status) != 0) {
+        strcpy(view_status, status);
+        mvaddstr(rows - 2, 0, status);
+        clrtoeol(); 
+    }
 }
 
 /**
@@ -506,6 +1020,18 @@ void handle_command(const char *cmd) {
             clrtoeol();
             getch();
         }
+    } else if (cmd[0] == 'f') {
+        const char *name = cmd + 1;
+        while (*name == ' ') name++;
+        if (*name == '\0') {
+            leave_file_view();
+        } else if (open_file_view(name) != 0) {
+            mvprintw(rows - 1, 2, "No such file, or it is empty: %s", name);
+            clrtoeol();
+            getch();
+        }
+    } else if (cmd[0] == '/') {
+        search_start(cmd + 1);
     } else if (cmd[0] == 's') {
         if (cmd[1] == 'a') {
             save_file(1); // Save As
@@ -524,6 +1050,7 @@ void display_help() {
     mvprintw(2, 0, "Navigation Keys:");
     mvprintw(3, 2, "Page Up/KEY_PPAGE/b: Go to previous sector");
     mvprintw(4, 2, "Page Down/KEY_NPAGE/space: Go to next sector");
+    mvprintw(5, 2, "> / <: Follow the sector link forward / back, ^: Go to the file start");
     mvprintw(6, 0, "Editing Mode (press 'e' at prompt):");
     mvprintw(7, 2, "TAB: Switch between Hex and ASCII fields.");
     mvprintw(8, 2, "Arrow Keys: Move cursor within the sector.");
@@ -532,13 +1059,18 @@ void display_help() {
     mvprintw(12, 2, "e - Enter Edit Mode for the current sector.");
     mvprintw(13, 2, "s - Save the file (uses current filename).");
     mvprintw(14, 2, "sa - Save As (prompts for new filename).");
-    mvprintw(15, 2, "g <offset> - Go to byte offset (e.g., 'g 0x400')");
-    mvprintw(16, 2, "t <track> <sector> - Go to track and sector (e.g., 't 1 1')");
-    mvprintw(17, 2, "h - Display this help screen");
-    mvprintw(18, 2, "q - Quit the program (prompts to save if modified)");
-    mvprintw(20, 0, "Press any key to return to the editor.");
+    mvprintw(15, 2, "u - Undo the last edit, r - Redo it.");
+    mvprintw(16, 2, "g <offset> - Go to byte offset (e.g., 'g 0x400')");
+    mvprintw(17, 2, "t <track> <sector> - Go to track and sector (e.g., 't 1 1')");
+    mvprintw(18, 2, "/<pattern> - Search: hex bytes '/41 42 ?? 43' or text '/\"NAME?TXT'");
+    mvprintw(19, 2, "n / N - Go to the next / previous match");
+    mvprintw(20, 2, "h - Display this help screen");
+    mvprintw(21, 2, "q - Quit the program (prompts to save if modified)");
+    mvprintw(22, 2, "f <NAME.EXT> - Show a file's data as one stream of bytes, f alone to go back");
+    mvprintw(23, 0, "Press any key to return to the editor.");
     refresh();
     getch();
+    view_offset = -1;
 }
 
 
@@ -546,8 +1078,6 @@ void display_help() {
  * @brief Main function.
  */
 int main(int argc, char *argv[]) {
-    FILE *disk_file_handle = NULL;
-
     if (argc == 1) {
         fprintf(stderr, "Usage: %s <disk_image_file>\n", argv[0]);
         return 1;
@@ -574,52 +1104,32 @@ int main(int argc, char *argv[]) {
         }
     }
 
-    disk_file_handle = fopen(argv[1], "rb"); 
-    if (!disk_file_handle) {
-        perror("Could not open disk image file for reading");
+    // Map the image privately; edits stay in memory until saved
+    if (flex_image_open(&disk, argv[1], FLEX_PRIVATE) != 0) {
+        fprintf(stderr, "Could not open disk image file for reading\n");
         return 1;
     }
     
     file_path = strdup(argv[1]);
 
     // Disk size in bytes
-    fseek(disk_file_handle, 0, SEEK_END);
-    file_size = ftell(disk_file_handle);
-    fseek(disk_file_handle, 0, SEEK_SET);
-
-    if (file_size == 0) {
-        fprintf(stderr, "Disk image file is empty.\n");
-        fclose(disk_file_handle);
-        free(file_path);
-        return 1;
-    }
-
-    // 2. Allocate memory and read entire file into it
-    disk_memory = (uint8_t *)malloc(file_size);
-
-    if (!disk_memory) {
-        fprintf(stderr, "Failed to allocate %ld bytes for disk image.\n", file_size);
-        fclose(disk_file_handle);
-        free(file_path);
+    disk_memory = disk.base;
+    file_size   = disk.size;
+    dirty_map   = calloc(DIRTY_MAP_BYTES, 1);
+    if (dirty_map == NULL) {
+        perror("calloc");
+        flex_image_close(&disk);
         return 1;
     }
 
-    if (fread(disk_memory, 1, file_size, disk_file_handle) != file_size) {
-        fprintf(stderr, "Error reading entire file into memory.\n");
-        free(disk_memory);
-        fclose(disk_file_handle);
-        free(file_path);
-        return 1;
-    }
-    
-    // Close the file handle; we now work exclusively in memory
-    fclose(disk_file_handle);
-
     current_offset = 0;
 
     // Get disk size in tracks and sectors
-    tracks_per_disk   = disk_memory[256 + 256 + 16 + 22]; // (0-255)
-    sectors_per_track = disk_memory[256 + 256 + 16 + 23]; // (1-255)
+    tracks_per_disk   = disk.tracks - 1;  // (0-255)
+    if (sectors_per_track == (uint16_t)-1) {
+        sectors_per_track = disk.sectors; // (1-255)
+    }
+    flex_image_geometry(&disk, tracks_per_disk + 1, sectors_per_track);
 
     init_curses();
 
@@ -645,6 +1155,10 @@ int main(int argc, char *argv[]) {
             display_help();
         } else if (ch == 'e') {
             handle_command("e");
+        } else if (ch == 'u') {
+            if (!journal_undo()) beep();
+        } else if (ch == 'r') {
+            if (!journal_redo()) beep();
         } else if (ch == 's') {
             nodelay(stdscr, TRUE);
             int next_ch = getch();
@@ -655,8 +1169,18 @@ int main(int argc, char *argv[]) {
                 if (next_ch != ERR) ungetch(next_ch); 
                 handle_command("s");
             }
-        } else if (ch == 'g' || ch == 't') {
-            // Enter command mode for 'g' or 't'
+        } else if (ch == '>') {
+            chain_step(1);
+        } else if (ch == '<') {
+            chain_step(-1);
+        } else if (ch == '^') {
+            chain_start();
+        } else if (ch == 'n') {
+            search_step(1);
+        } else if (ch == 'N') {
+            search_step(-1);
+        } else if (ch == 'g' || ch == 't' || ch == '/' || ch == 'f') {
+            // Enter command mode for 'g', 't', '/' or 'f'
             echo(); 
             curs_set(1); 
             mvprintw(rows - 1, 0, "> %c", ch);
@@ -674,8 +1198,12 @@ int main(int argc, char *argv[]) {
     }
 
     close_curses();
-    // 3. Free the allocated memory
-    if (disk_memory) free(disk_memory);
+    // 3. Unmap the image
+    flex_image_close(&disk);
+    flex_search_free(&search);
+    flex_index_free(&chain_index);
+    free(file_chain);
+    free(dirty_map);
     if (file_path) free(file_path);
 
     return 0;
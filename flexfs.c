@@ -6,6 +6,10 @@
 #include <fcntl.h>
 #include <time.h>
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include <sys/stat.h>
 #include "flexfs.h"
 
 /* FLEX stores text files in a slightly weird 'space compressed' format. This
@@ -22,169 +26,203 @@
    We blindly obey nonsense expansion sizes, it's better to have 250 spaces
    than an error code usually */
    
-static uint8_t decompstate;
+/* The decoding itself is flex_text_decode() in libflexfs. Output for one
+   sector is at most DECOMP_MAX bytes */
+#define DECOMP_MAX      FLEX_TEXT_MAX(252)
 
-static void reset_decompress(void)
+/* Low level disk I/O */
+static SIR_struct sir;
+static FLEX_IMAGE disk;
+static int sync_image;
+
+static void sir_setsecfree(uint16_t secs)
 {
-    decompstate = 0;
+    sir.freeSectorsLo = secs;
+    sir.freeSectorsHi = secs >> 8;
 }
 
-static void decompbyte(uint8_t c, FILE *fp)
+/* Sectors are pointers straight into the mapped image, so writing to the
+   returned buffer writes the disk */
+static uint8_t *disk_sector(int track, int sec)
 {
-    switch(decompstate) {
-    case 0:
-        if (c == 0)
-            return;
-        if (c == 0x18)
-            return;
-        if (c == 0x09) {
-            decompstate = 1;
-            return;
-        }
-        if (c == 0x0D)
-            c = '\n';
-        fputc(c, fp);
-        break;
-    case 1:
-        while(c--)
-            fputc(' ', fp);
-        decompstate = 0;
-        break;
+    uint8_t *p = flex_image_sector(&disk, track, sec);
+    if (p == NULL) {
+        fprintf(stderr, "sector (%d,%d) is outside the image.\n", track, sec);
+        exit(1);
     }
+    return p;
 }
 
-static void decompress(uint8_t *buf, int len, FILE *fp)
+static uint8_t *workbuf;
+
+/* Allocation map used by the checker: the owner of each sector (0 unused,
+   directory slot + 1, or OWNER_FREE for the free chain) so cross links can
+   name both files. The checker workers claim sectors in it atomically.
+   Owners are 32 bits, a directory may fill the disk with far more than
+   65535 slots */
+#define OWNER_FREE      0xFFFFFFFF
+
+static _Atomic uint32_t *flex_owner;
+static int check_threads;
+
+/* Threads for a pool working through jobs: -j, else one per CPU */
+static int pool_threads(int jobs)
 {
-    while(len--)
-        decompbyte(*buf++, fp);
+    int nthreads = check_threads;
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads > jobs)
+        nthreads = jobs;
+    if (nthreads < 1)
+        nthreads = 1;
+    return nthreads;
 }
 
-/* Low level disk I/O */
-static struct sir sir;
-static int disk_fd;
+/* Directory index. This is built once at mount time: every entry of the
+   directory chain is recorded in order, names are hashed into an open
+   addressed table and the unused entries are kept on a free list, so
+   lookup, create and unlink no longer rescan the chain */
+#define DIR_HASH_EMPTY  -1
+#define DIR_HASH_DEAD   -2
 
-static void sir_setsecfree(uint16_t secs)
+static struct dir **dir_slots;
+static int dir_nslots;
+static int *dir_hash;
+static int dir_hashmask;
+static int *dir_free;
+static int dir_nfree;
+static int dirpt;
+
+static int dir_inuse(struct dir *d)
 {
-    sir.secfreel = secs;
-    sir.secfreeh = secs >> 8;
+    return d->name[0] != 0 && !(d->name[0] & 0x80);
 }
 
-static off_t disk_offset(int track, int sec)
+/* Hash the name as strncmp() would compare it, stopping at a NUL */
+static unsigned int dir_hashname(const char *name, const char *ext)
 {
-    off_t pos = track * sir.endsector;
-    if (track == 0 && sec < 2)
-        sec++;
-    pos += sec - 1;
-    pos *= 256;
-    return pos;
+    unsigned int h = 2166136261U;
+    int i;
+    for (i = 0; i < 8 && name[i]; i++)
+        h = (h ^ (uint8_t)name[i]) * 16777619U;
+    h = (h ^ '.') * 16777619U;
+    for (i = 0; i < 3 && ext[i]; i++)
+        h = (h ^ (uint8_t)ext[i]) * 16777619U;
+    return h;
 }
 
-static void disk_read(int track, int sec, uint8_t *buf)
+static void dir_hash_insert(int slot)
 {
-    off_t pos = disk_offset(track, sec);
-    int l;
-    if (lseek(disk_fd, pos, SEEK_SET) < 0) {
-        perror("lseek");
-        exit(1);
+    struct dir *d = dir_slots[slot];
+    unsigned int h = dir_hashname(d->name, d->ext) & dir_hashmask;
+    while (dir_hash[h] >= 0)
+        h = (h + 1) & dir_hashmask;
+    dir_hash[h] = slot;
+}
+
+static int dir_lookup(const char *name, const char *ext)
+{
+    unsigned int h = dir_hashname(name, ext) & dir_hashmask;
+    while (dir_hash[h] != DIR_HASH_EMPTY) {
+        int slot = dir_hash[h];
+        if (slot >= 0) {
+            struct dir *d = dir_slots[slot];
+            if (strncmp(name, d->name, 8) == 0 && strncmp(ext, d->ext, 3) == 0)
+                return slot;
+        }
+        h = (h + 1) & dir_hashmask;
     }
-    if ((l = read(disk_fd, buf, 256)) != 256) {
-        if (l < 0)
-            perror("read");
-        else
-            fprintf(stderr, "read: short read (%d,%d)->%ld.\n", track, sec, pos);
-        exit(1);
+    return -1;
+}
+
+static void dir_hash_remove(int slot)
+{
+    struct dir *d = dir_slots[slot];
+    unsigned int h = dir_hashname(d->name, d->ext) & dir_hashmask;
+    while (dir_hash[h] != DIR_HASH_EMPTY) {
+        if (dir_hash[h] == slot) {
+            dir_hash[h] = DIR_HASH_DEAD;
+            return;
+        }
+        h = (h + 1) & dir_hashmask;
     }
 }
 
-static void disk_write(int track, int sec, uint8_t *buf)
+static void dir_index(void)
 {
-    off_t pos = disk_offset(track, sec);
-    int l;
-    if (lseek(disk_fd, pos, SEEK_SET) < 0) {
-        perror("lseek");
+    uint8_t *buf;
+    uint8_t trk = 0, sec = 5;
+    int nsec = 0;
+    int size = 16;
+    int cap = 0;
+    int i;
+
+    /* Collect the entries, a link off the end of the image or more
+       sectors than the disk holds ends the directory */
+    buf = disk_sector(0, 5);
+    do {
+        if (dir_nslots + 10 > cap) {
+            struct dir **slots;
+            cap = cap ? 2 * cap : 160;
+            slots = realloc(dir_slots, cap * sizeof(struct dir *));
+            if (slots == NULL) {
+                fprintf(stderr, "Out of memory.\n");
+                exit(1);
+            }
+            dir_slots = slots;
+        }
+        for (i = 0; i < 10; i++)
+            dir_slots[dir_nslots++] = (struct dir *)(buf + 24 * i + 16);
+        trk = buf[0];
+        sec = buf[1];
+        if (++nsec > (sir.endTrack + 1) * sir.endSector)
+            break;
+    } while ((trk || sec) && (buf = flex_image_sector(&disk, trk, sec)) != NULL);
+
+    while (size < 2 * dir_nslots)
+        size <<= 1;
+    dir_hashmask = size - 1;
+    dir_hash = malloc(size * sizeof(int));
+    dir_free = malloc(dir_nslots * sizeof(int));
+    if (dir_hash == NULL || dir_free == NULL) {
+        fprintf(stderr, "Out of memory.\n");
         exit(1);
     }
-    if ((l = write(disk_fd, buf, 256)) != 256) {
-        if (l < 0)
-            perror("write");
+    for (i = 0; i < size; i++)
+        dir_hash[i] = DIR_HASH_EMPTY;
+    /* Free list is a stack, push in reverse so the first free entry in
+       directory order is handed out first */
+    dir_nfree = 0;
+    for (i = dir_nslots - 1; i >= 0; i--) {
+        if (dir_inuse(dir_slots[i]))
+            dir_hash_insert(i);
         else
-            fprintf(stderr, "write: short write.\n");
-        exit(1);
+            dir_free[dir_nfree++] = i;
     }
 }
 
-static int disk_read_next(uint8_t *buf)
-{
-    if (buf[0] ==0 && buf[1] == 0)
-        return 0;
-    disk_read(buf[0], buf[1], buf);
-    return 1;
-}
-
-static uint8_t workbuf[256];
-static uint8_t dirbuf[256];
-static uint8_t dirtrk;
-static uint8_t dirsec;
-static int dirpt;
-static uint16_t *flex_map;
-
 static void dir_begin(void)
 {
-    disk_read(0, 5, dirbuf);
-    dirtrk = 0;
-    dirsec = 5;
-    dirpt = 1;
+    dirpt = 0;
 }
 
 static struct dir *dir_get(void)
 {
-    return (struct dir *)(dirbuf + 24 * dirpt + 16);
+    return dir_slots[dirpt];
 }
 
 static int dir_next(void)
 {
-    dirpt++;
-    if (dirpt == 10) {
-        dirpt = 1;
-        dirtrk = dirbuf[0];
-        dirsec = dirbuf[1];
-        return disk_read_next(dirbuf);
-    } else
-        return 1;
-}
-
-static void dir_write(void)
-{
-    disk_write(dirtrk, dirsec, dirbuf);
-}
-
-static int dir_match(const char *name, const char *ext)
-{
-    struct dir *d = dir_get();
-    if (strncmp(name, d->name, 8) == 0 && strncmp(ext, d->ext, 3) == 0)
-        return 1;
-    return 0;
+    return ++dirpt < dir_nslots;
 }
 
 static struct dir *dir_find(const char *name, const char *ext)
 {
-    dir_begin();
-    do {
-        if (dir_match(name, ext))
-            return dir_get();
-    } while(dir_next());
-    return NULL;
-}
-
-static struct dir *dir_findfree(void)
-{
-    dir_begin();
-    do {
-        struct dir *d = dir_get();
-        if (d->name[0] == 0 || d->name[0] & 0x80)
-            return d;
-    } while(dir_next());
-    return NULL;
+    int slot = dir_lookup(name, ext);
+    if (slot < 0)
+        return NULL;
+    return dir_slots[slot];
 }
 
 static void timestamp(struct dir *d)
@@ -198,246 +236,626 @@ static void timestamp(struct dir *d)
 
 static int read_sir(void)
 {
-    if (lseek(disk_fd, 512 + 16, SEEK_SET) < 0)
-        return -1;
-    if (read(disk_fd, &sir, sizeof(struct sir)) != sizeof(struct sir))
+    SIR_struct *p = flex_image_sir(&disk);
+    if (p == NULL)
         return -1;
+    memcpy(&sir, p, sizeof(sir));
     return 0;
 }
 
 static void write_sir(void)
 {
-    if (lseek(disk_fd, 512 + 16, SEEK_SET) < 0 || write(disk_fd, &sir, sizeof(struct sir)) != sizeof(struct sir)) {
-        perror("write sir");
-        exit(1);
-    }
+    memcpy(flex_image_sir(&disk), &sir, sizeof(sir));
 }
 
 static int flex_mount(void)
 {
     if (read_sir() < 0)
         return -1;
-//    if (sir.month > 12 || sir.day > 31 || sir.day == 0)
+//    if (sir.dateMonth > 12 || sir.dateDay > 31 || sir.dateDay == 0)
 //        return -1;
-    if (sir.endtrack < 34 || sir.endsector < 9)
+    if (sir.endTrack < 34 || sir.endSector < 9)
         return -1;
     printf("Mounting volume %-11.11s serial %d  %02d/%02d/%02d\n",
-        sir.label, (sir.volh << 8) | sir.voll, 
-        sir.day, sir.month, sir.year);
+        sir.volLabel, (sir.volNumberHi << 8) | sir.volNumberLo, 
+        sir.dateDay, sir.dateMonth, sir.dateYear);
     printf("Disk geometry is %d tracks, %d sectors per track.\n",
-        sir.endtrack + 1, sir.endsector);
+        sir.endTrack + 1, sir.endSector);
     return 0;
 }
 
-static int mark_block_chain(const char *name, uint16_t code, uint8_t track, uint8_t sec, uint8_t etrack, uint8_t esec)
+#define map_test(pos)   (flex_owner[pos] != 0)
+
+/* The result of walking one chain, reported after all workers are done */
+#define CHAIN_OK        0
+#define CHAIN_CORRUPT   1
+#define CHAIN_LOOP      2
+
+struct chain_check {
+    int walked;             /* Entry was checked */
+    int count;              /* Sectors claimed */
+    int error;
+    uint8_t track, sec;     /* Where the walk stopped */
+};
+
+/* Two chains share blocks from pos on; lo keeps them in the map */
+struct cross_link {
+    uint32_t lo, hi;
+    int pos;
+};
+
+struct check_worker {
+    pthread_t thread;
+    struct cross_link *links;
+    int nlinks;
+    int maxlinks;
+};
+
+static struct chain_check *flex_check;
+static atomic_int check_next;
+
+static void owner_name(uint32_t owner, char *buf)
+{
+    struct dir *d;
+    if (owner == OWNER_FREE) {
+        strcpy(buf, "free");
+        return;
+    }
+    d = dir_slots[owner - 1];
+    snprintf(buf, 16, "%.8s.%.3s", d->name, d->ext);
+}
+
+static void add_link(struct check_worker *w, uint32_t lo, uint32_t hi, int pos)
 {
-    int count = 0;
+    if (w->nlinks == w->maxlinks) {
+        w->maxlinks = w->maxlinks ? 2 * w->maxlinks : 16;
+        w->links = realloc(w->links, w->maxlinks * sizeof(struct cross_link));
+        if (w->links == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    w->links[w->nlinks].lo = lo;
+    w->links[w->nlinks].hi = hi;
+    w->links[w->nlinks].pos = pos;
+    w->nlinks++;
+}
+
+/* Claim a sector for owner. When two chains meet the lower owner always
+   ends up holding the shared blocks, so the map and the report do not
+   depend on which worker got there first. Returns 0 to stop the walk */
+static int claim_block(struct check_worker *w, struct chain_check *c, uint32_t owner,
+                       int pos, uint32_t *taken)
+{
+    uint32_t cur = atomic_load(&flex_owner[pos]);
+    for (;;) {
+        if (cur == owner) {
+            c->error = CHAIN_LOOP;
+            return 0;
+        }
+        if (cur != 0 && cur < owner) {
+            add_link(w, cur, owner, pos);
+            return 0;
+        }
+        if (atomic_compare_exchange_weak(&flex_owner[pos], &cur, owner)) {
+            if (cur != 0 && cur != *taken) {
+                add_link(w, owner, cur, pos);
+                *taken = cur;
+            }
+            return 1;
+        }
+    }
+}
+
+static void check_chain(struct check_worker *w, uint32_t owner, uint8_t track, uint8_t sec)
+{
+    struct chain_check *c = &flex_check[owner == OWNER_FREE ? dir_nslots : owner - 1];
+    int nsec = (sir.endTrack + 1) * sir.endSector;
+    uint32_t taken = 0;
+    uint8_t *p;
     int pos;
+
+    c->walked = 1;
     while(track || sec) {
-        if (sec == 0 || sec > sir.endsector || track == 0 || track > sir.endtrack) {
-            fprintf(stderr, "%s: corrupt sector chain reference (%d,%d)\n",
-                name, track, sec);
+        if (sec == 0 || sec > sir.endSector || track == 0 || track > sir.endTrack ||
+            (p = flex_image_sector(&disk, track, sec)) == NULL) {
+            c->error = CHAIN_CORRUPT;
+            break;
+        }
+        pos = track * sir.endSector + (sec - 1);
+        if (c->count >= nsec) {
+            c->error = CHAIN_LOOP;
             break;
         }
-        disk_read(track, sec, workbuf);
-        pos = track * sir.endsector + (sec - 1);
-        switch (flex_map[pos]) {
-            case 0xFFFF:
-                flex_map[pos] = code;
-                break;
-            case 0xFFFE:
-                fprintf(stderr, "%s: block (%d,%d) is on free chain.\n", name, track, sec);
-                break;
-            case 0x0001:
-                fprintf(stderr, "%s: block (%d,%d) is in another file.\n", name, track, sec);
-                break;
-            /* TODO: relace 0x0001 etc with the directory count from start of
-               dir so we can report which file */
-            default:
-                fprintf(stderr, "%s: bad value %04X in map.\n", name, flex_map[pos]);
-        }
-        count++;
-        if (*workbuf == 0 && workbuf[1] == 0)
+        if (!claim_block(w, c, owner, pos, &taken))
             break;
-        track = *workbuf;
-        sec = workbuf[1];
+        c->count++;
+        /* Only the link bytes are needed, read them in place */
+        if (p[0] == 0 && p[1] == 0)
+            break;
+        track = p[0];
+        sec = p[1];
     }
-    if (track != etrack || sec != esec)
-        fprintf(stderr, "%s: end of chain is (%d,%d) but should be (%d,%d).\n",
-            name, track, sec, etrack, esec);
-    return count;
+    c->track = track;
+    c->sec = sec;
 }
 
-static void mark_blocks_used(struct dir *d)
+static void *check_worker(void *arg)
 {
-    char buf[16];
-    int count;
-    snprintf(buf, 16, "%.8s.%.3s", d->name, d->ext);
-    count = mark_block_chain(buf, 0x0001, d->strack, d->ssec, d->etrack, d->esec);
-    if (count != ((d->sech << 8) | d->secl))
+    struct check_worker *w = arg;
+    struct dir *d;
+    int job;
+
+    /* Directory entries are handed out one at a time, the free chain is
+       the last job */
+    while ((job = atomic_fetch_add(&check_next, 1)) <= dir_nslots) {
+        if (job == dir_nslots) {
+            check_chain(w, OWNER_FREE, sir.firstFreeTrack, sir.firstFreeSector);
+            continue;
+        }
+        d = dir_slots[job];
+        if (dir_inuse(d))
+            check_chain(w, job + 1, d->strack, d->ssec);
+    }
+    return NULL;
+}
+
+static int link_cmp(const void *a, const void *b)
+{
+    const struct cross_link *la = a, *lb = b;
+    if (la->hi != lb->hi)
+        return la->hi < lb->hi ? -1 : 1;
+    if (la->pos != lb->pos)
+        return la->pos < lb->pos ? -1 : 1;
+    if (la->lo != lb->lo)
+        return la->lo < lb->lo ? -1 : 1;
+    return 0;
+}
+
+/* Report one chain. A chain that ran into a lower one is only reported as
+   a cross link, the rest of it belongs to (and is checked as) the other */
+static void report_chain(uint32_t owner, struct cross_link *links, int nlinks,
+                         uint8_t etrack, uint8_t esec, int sectors)
+{
+    struct chain_check *c = &flex_check[owner == OWNER_FREE ? dir_nslots : owner - 1];
+    char name[16], other[16];
+    int joined = 0;
+    int i;
+
+    owner_name(owner, name);
+    for (i = 0; i < nlinks; i++) {
+        if (links[i].hi != owner)
+            continue;
+        if (i > 0 && links[i].pos == links[i - 1].pos && links[i].hi == links[i - 1].hi &&
+            links[i].lo == links[i - 1].lo)
+            continue;
+        owner_name(links[i].lo, other);
+        if (owner == OWNER_FREE)
+            fprintf(stderr, "%s: block (%d,%d) is in %s.\n", name,
+                links[i].pos / sir.endSector, links[i].pos % sir.endSector + 1, other);
+        else
+            fprintf(stderr, "%s: block (%d,%d) is cross linked with %s.\n", name,
+                links[i].pos / sir.endSector, links[i].pos % sir.endSector + 1, other);
+        joined = 1;
+    }
+    if (joined)
+        return;
+    if (c->error == CHAIN_CORRUPT)
+        fprintf(stderr, "%s: corrupt sector chain reference (%d,%d)\n",
+            name, c->track, c->sec);
+    else if (c->error == CHAIN_LOOP)
+        fprintf(stderr, "%s: chain loops back to block (%d,%d).\n", name, c->track, c->sec);
+    if (c->track != etrack || c->sec != esec)
+        fprintf(stderr, "%s: end of chain is (%d,%d) but should be (%d,%d).\n",
+            name, c->track, c->sec, etrack, esec);
+    if (owner == OWNER_FREE) {
+        if (c->count != sectors)
+            fprintf(stderr, "%d blocks in the free chain, space free claims to be %d blocks.\n",
+                c->count, sectors);
+    } else if (c->count != sectors)
         fprintf(stderr, "%s: block chain length does not match sectors (%d v %d).\n",
-            buf, (d->sech << 8) | d->secl, count);
+            name, sectors, c->count);
 }
 
+/* Check every chain with a pool of workers walking the read only image,
+   then merge their results in directory order */
 static void flex_buildmap(void)
 {
-    struct dir *d;
-    int count;
-    if (flex_map)
-        free(flex_map);
-    flex_map = calloc((sir.endtrack + 1) * sir.endsector, sizeof(uint16_t));
-    if (flex_map == NULL) {
+    int nsec = (sir.endTrack + 1) * sir.endSector;
+    struct check_worker *workers;
+    struct cross_link *links = NULL;
+    int nthreads = pool_threads(dir_nslots + 1);
+    int nlinks = 0;
+    int i;
+
+    free((void *)flex_owner);
+    free(flex_check);
+    flex_owner = calloc(nsec, sizeof(*flex_owner));
+    flex_check = calloc(dir_nslots + 1, sizeof(struct chain_check));
+    workers = calloc(nthreads, sizeof(struct check_worker));
+    if (flex_owner == NULL || flex_check == NULL || workers == NULL) {
         fprintf(stderr, "Out of memory.\n");
         exit(1);
     }
-    memset(flex_map, 0xFF, (sir.endtrack + 1) * sir.endsector * sizeof(uint16_t));
 
-    dir_begin();
-    do {
-        d = dir_get();
-        if (d->name[0] && !(d->name[0] & 0x80))
-            mark_blocks_used(d);
-    } while(dir_next());
-    count = mark_block_chain("free", 0xFFFE, sir.ffreetrack, sir.ffreesec, sir.lfreetrack, sir.lfreesec);
-    if (count != sir_secfree()) {
-        fprintf(stderr, "%d blocks in the free chain, space free claims to be %d blocks.\n",
-            count, sir_secfree());
+    atomic_store(&check_next, 0);
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, check_worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
     }
+    check_worker(&workers[0]);
+    for (i = 1; i < nthreads; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    for (i = 0; i < nthreads; i++) {
+        links = realloc(links, (nlinks + workers[i].nlinks + 1) * sizeof(struct cross_link));
+        if (links == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+        memcpy(links + nlinks, workers[i].links, workers[i].nlinks * sizeof(struct cross_link));
+        nlinks += workers[i].nlinks;
+        free(workers[i].links);
+    }
+    free(workers);
+    qsort(links, nlinks, sizeof(struct cross_link), link_cmp);
+
+    for (i = 0; i < dir_nslots; i++) {
+        struct dir *d = dir_slots[i];
+        if (flex_check[i].walked)
+            report_chain(i + 1, links, nlinks, d->etrack, d->esec, (d->sech << 8) | d->secl);
+    }
+    report_chain(OWNER_FREE, links, nlinks, sir.lastFreeTrack, sir.lastFreeSector, sir_secfree());
+    free(links);
 }
 
 static int flex_unlink(const char *name, const char *ext)
 {
-    struct dir *d = dir_find(name, ext);
+    int slot = dir_lookup(name, ext);
+    struct dir *d;
     uint16_t freesec;
-    if (d == NULL)
+    if (slot < 0)
         return -1;
+    d = dir_slots[slot];
+    dir_hash_remove(slot);
+    dir_free[dir_nfree++] = slot;
     d->name[0] |= 0x80;
     if (d->etrack || d->esec) {
-        disk_read(d->etrack, d->esec, workbuf);
+        workbuf = disk_sector(d->etrack, d->esec);
         /* Hook the existing free list onto the end of the file chain */
-        *workbuf = sir.ffreetrack;
-        workbuf[1] = sir.ffreesec;
+        *workbuf = sir.firstFreeTrack;
+        workbuf[1] = sir.firstFreeSector;
         /* Update the free sector count
          */
         freesec = sir_secfree();
         freesec += dir_sectors(d);
         sir_setsecfree(freesec);
-        disk_write(d->etrack, d->esec, workbuf);
         /* Now add it to the SIR */
-        sir.ffreetrack = d->strack;
-        sir.ffreesec = d->ssec;
+        sir.firstFreeTrack = d->strack;
+        sir.firstFreeSector = d->ssec;
         write_sir();
     }
     d->etrack = d->esec = d->ssec = d->strack = 0;
-    dir_write();
     return 0;
 }
 
 static struct dir *flex_create(const char *name, const char *ext)
 {
     struct dir *d = dir_find(name, ext);
+    int slot;
     if (d != NULL)
         return NULL;		/* Exists */
-    d = dir_findfree();
+    if (dir_nfree == 0) {
+        fprintf(stderr, "Directory full.\n");
+        return NULL;
+    }
+    slot = dir_free[--dir_nfree];
+    d = dir_slots[slot];
     memset(d, 0, sizeof(*d));
     strncpy(d->name, name, 8);
     strncpy(d->ext, ext, 3);
+    dir_hash_insert(slot);
     timestamp(d);
     d->strack = 0;
     d->ssec = 0;
     d->etrack = 0;
     d->esec = 0;
-    dir_write();
     return d;
 }
 
-/* Add a 256 byte sector to a file */
-static int flex_append(struct dir *d, const char *buf)
+/* Files to put. They are all planned before anything is written: the
+   sectors for every file come off the free chain in one walk, sorted so the
+   data goes out in ascending track/sector order, and the directory and SIR
+   are committed once at the end */
+struct put_file {
+    const char *path;
+    char name[9];
+    char ext[4];
+    long size;
+    int nsec;
+    struct dir *slot;
+    int slotno;			/* Index of slot in dir_slots */
+    struct dir old;		/* What slot held before, for a rollback */
+    FILE *fp;			/* Opened while planning */
+};
+
+static struct put_file *put_files;
+static int put_nfiles;
+
+static void put_add(const char *path, const char *flexname)
 {
-    uint8_t trk,sec;
-    /* Space ? */
-    if (sir_secfree() == 0)
-        return -1;
-    /* If we have sectors already then change the end pointer of the last one */
-    if (d->esec || d->etrack) {
-        disk_read(d->etrack, d->esec, workbuf);
-        workbuf[0] = sir.ffreetrack;
-        workbuf[1] = sir.ffreesec;
-        disk_write(d->etrack, d->esec, workbuf);
-    }
-    /* Update the sir, dir and new sector */
-    trk = sir.ffreetrack;
-    sec = sir.ffreesec;
-    disk_read(trk, sec, workbuf);
-    sir.ffreetrack = *workbuf;
-    sir.ffreesec = workbuf[1];
-    /* First block - update the header */
-    if (d->etrack == 0 && d->esec == 0) {
-        d->strack = trk;
-        d->ssec = sec;
-    }
-    d->etrack = trk;
-    d->esec = sec;
-    /* Adjust sec count in directory */
-    d->secl++;
-    if (d->secl == 0)
-        d->sech++;
-    *workbuf = 0;
-    workbuf[1] = 0;
-    /* Sectors have logical record numbers 1+ */
-    workbuf[2] = d->sech;
-    workbuf[3] = d->secl;
-    /* Add the data */
-    memcpy(workbuf + 4, buf, 252);
-    disk_write(trk, sec, workbuf);
-    /* Adjust sir.secfree */
-    sir_setsecfree(sir_secfree() - 1);
-    dir_write();
-    write_sir();
-    return 0;
+    struct put_file *f;
+    const char *base, *dot;
+    int i, n;
+
+    put_files = realloc(put_files, (put_nfiles + 1) * sizeof(struct put_file));
+    if (put_files == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    f = &put_files[put_nfiles++];
+    memset(f, 0, sizeof(*f));
+    f->path = path;
+    if (flexname) {
+        /* Name given, used as is */
+        dot = strchr(flexname, '.');
+        n = dot ? dot - flexname : (int)strlen(flexname);
+        snprintf(f->name, sizeof(f->name), "%.*s", n < 8 ? n : 8, flexname);
+        snprintf(f->ext, sizeof(f->ext), "%.3s", dot ? dot + 1 : "");
+        return;
+    }
+    /* Named after the linux file, upper cased as FLEX expects */
+    base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    dot = strrchr(base, '.');
+    n = dot ? dot - base : (int)strlen(base);
+    for (i = 0; i < n && i < 8; i++)
+        f->name[i] = toupper((uint8_t)base[i]);
+    for (i = 0; dot && dot[i + 1] && i < 3; i++)
+        f->ext[i] = toupper((uint8_t)dot[i + 1]);
 }
 
-static int flex_addfile(const char *name, const char *ext, FILE *inf)
+/* A manifest has one file per line: linuxfile [file.ext] */
+static void put_manifest(const char *path)
 {
-    char buf[252];
-    int l;
-    struct dir *d;
-    d = flex_create(name, ext);
-    if (d == NULL)
-        return -1;
-    while((l = fread(buf, 1, 252, inf)) > 0) {
-        /* Flex zeroes unused space and the Flex file formats need that */
-        if (l != 252)
-            memset(buf + l, 0,252 - l);
-        flex_append(d, buf);
-    }
-    if (l == -1) {
-        perror("read");
+    FILE *fp = fopen(path, "r");
+    char line[512];
+    char *host, *flexname;
+
+    if (fp == NULL) {
+        perror(path);
         exit(1);
     }
-    return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        host = strtok(line, " \t\r\n");
+        if (host == NULL || *host == '#')
+            continue;
+        flexname = strtok(NULL, " \t\r\n");
+        put_add(strdup(host), flexname ? strdup(flexname) : NULL);
+    }
+    fclose(fp);
+}
+
+static int sector_cmp(const void *a, const void *b)
+{
+    const uint8_t *sa = a, *sb = b;
+    if (sa[0] != sb[0])
+        return sa[0] - sb[0];
+    return sa[1] - sb[1];
+}
+
+/* Give a planned file's directory entry back as it was */
+static void put_backout(struct put_file *f)
+{
+    dir_hash_remove(f->slotno);
+    *f->slot = f->old;
+    dir_free[dir_nfree++] = f->slotno;
+    f->slot = NULL;
+}
+
+static int flex_putfiles(void)
+{
+    uint8_t (*chain)[2];
+    struct put_file *f;
+    struct stat st;
+    struct dir d;
+    long total = 0;
+    uint8_t trk, sec;
+    uint8_t *p;
+    FILE *fp;
+    int errors = 0;
+    int i, j, n, l;
+
+    /* Plan: open and size every file and claim its directory entry, so
+       nothing that can be refused is found after the map is written */
+    for (i = 0; i < put_nfiles; i++) {
+        f = &put_files[i];
+        if ((f->fp = fopen(f->path, "r")) == NULL || fstat(fileno(f->fp), &st) < 0) {
+            perror(f->path);
+            errors++;
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            fprintf(stderr, "%s: not a regular file.\n", f->path);
+            errors++;
+            continue;
+        }
+        if (dir_find(f->name, f->ext)) {
+            fprintf(stderr, "%s.%s: file exists.\n", f->name, f->ext);
+            errors++;
+            continue;
+        }
+        /* flex_create() takes the slot on top of the free stack, keep its
+           old bytes: a deleted entry must stay deleted if we back out */
+        if (dir_nfree > 0) {
+            f->slotno = dir_free[dir_nfree - 1];
+            f->old = *dir_slots[f->slotno];
+        }
+        f->slot = flex_create(f->name, f->ext);
+        if (f->slot == NULL) {
+            errors++;
+            continue;
+        }
+        f->size = st.st_size;
+        f->nsec = (f->size + 251) / 252;
+        total += f->nsec;
+    }
+
+    /* Take the sectors for all of them off the free chain in one walk */
+    chain = malloc((total + 1) * sizeof(*chain));
+    if (chain == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    trk = sir.firstFreeTrack;
+    sec = sir.firstFreeSector;
+    for (n = 0; n < total && (trk || sec); n++) {
+        if ((p = flex_image_sector(&disk, trk, sec)) == NULL)
+            break;
+        chain[n][0] = trk;
+        chain[n][1] = sec;
+        trk = p[0];
+        sec = p[1];
+    }
+    if (n < total || total > sir_secfree()) {
+        fprintf(stderr, "Not enough space: %ld sectors needed, %d free.\n",
+            total, sir_secfree());
+        /* Nothing written yet, just give the directory entries back as
+           they were, newest first so the free stack is as it was */
+        for (i = put_nfiles - 1; i >= 0; i--) {
+            f = &put_files[i];
+            if (f->fp)
+                fclose(f->fp);
+            if (f->slot)
+                put_backout(f);
+        }
+        free(chain);
+        return -1;
+    }
+    qsort(chain, total, sizeof(*chain), sector_cmp);
+
+    /* Write the data, each sector once with its link already set */
+    for (i = 0, j = 0; i < put_nfiles; i++) {
+        f = &put_files[i];
+        fp = f->fp;
+        if (f->slot == NULL) {
+            if (fp)
+                fclose(fp);
+            continue;
+        }
+        d = *f->slot;
+        for (n = 0; n < f->nsec; n++, j++) {
+            p = disk_sector(chain[j][0], chain[j][1]);
+            if (n + 1 < f->nsec) {
+                p[0] = chain[j + 1][0];
+                p[1] = chain[j + 1][1];
+            } else
+                p[0] = p[1] = 0;
+            /* Sectors have logical record numbers 1+ */
+            p[2] = (n + 1) >> 8;
+            p[3] = n + 1;
+            /* Flex zeroes unused space and the Flex file formats need that */
+            l = fread(p + 4, 1, 252, fp);
+            if (l < 252)
+                memset(p + 4 + l, 0, 252 - l);
+        }
+        if (ferror(fp)) {
+            /* Drop the file: its sectors go back on the front of the
+               free chain and its entry back to what it was */
+            perror(f->path);
+            fclose(fp);
+            errors++;
+            if (f->nsec) {
+                p = disk_sector(chain[j - 1][0], chain[j - 1][1]);
+                p[0] = trk;
+                p[1] = sec;
+                if (trk == 0 && sec == 0) {
+                    sir.lastFreeTrack = chain[j - 1][0];
+                    sir.lastFreeSector = chain[j - 1][1];
+                }
+                trk = chain[j - f->nsec][0];
+                sec = chain[j - f->nsec][1];
+                total -= f->nsec;
+            }
+            put_backout(f);
+            continue;
+        }
+        fclose(fp);
+        if (f->nsec) {
+            d.strack = chain[j - f->nsec][0];
+            d.ssec = chain[j - f->nsec][1];
+            d.etrack = chain[j - 1][0];
+            d.esec = chain[j - 1][1];
+        }
+        d.sech = f->nsec >> 8;
+        d.secl = f->nsec;
+        *f->slot = d;
+    }
+    free(chain);
+
+    /* Commit the SIR once */
+    sir.firstFreeTrack = trk;
+    sir.firstFreeSector = sec;
+    if (trk == 0 && sec == 0)
+        sir.lastFreeTrack = sir.lastFreeSector = 0;
+    sir_setsecfree(sir_secfree() - total);
+    write_sir();
+    if (sync_image && flex_image_sync(&disk) < 0)
+        exit(1);
+    return errors ? -1 : 0;
 }
 
 static int flex_dump(struct dir *d, FILE *outf, int ascii)
 {
+    uint8_t out[DECOMP_MAX];
+    FLEX_OUTPUT output;
+    FLEX_CHAIN chain;
+    FLEX_TEXT text;
+    const uint8_t *link, *data;
+    const uint8_t *last = NULL;
     int count = 0;
-    reset_decompress();
-    /* Dump each sector in turn */
+    int len;
+    flex_text_init(&text, 0);
+    /* Dump each sector in turn, consecutive runs are paged in together */
     if (d->strack == 0 && d->ssec == 0)
         return 0;
-    disk_read(d->strack, d->ssec, workbuf);
-    do {
-        count++;
-        if (((workbuf[2] << 8) | workbuf[3]) != count)
+    /* Binary payloads go straight from the map to the file */
+    if (!ascii) {
+        fflush(outf);
+        flex_output_init(&output, fileno(outf));
+    }
+    flex_chain_start(&chain, &disk, d->strack, d->ssec, dir_sectors(d));
+    while ((link = flex_chain_next(&chain, &data)) != NULL) {
+        if (++count > (sir.endTrack + 1) * sir.endSector) {
+            fprintf(stderr, "%s.%s: chain loops.\n", d->name, d->ext);
+            exit(1);
+        }
+        if (((link[2] << 8) | link[3]) != count)
             fprintf(stderr, "%s.%s: sector %d has a sector count of %d.\n",
-                d->name, d->ext, count, (workbuf[2] << 8) | workbuf[3]);
-        if (ascii)
-            decompress(workbuf + 4, 252, outf);
-        else if (fwrite(workbuf + 4, 252, 1, outf) != 1) {
+                d->name, d->ext, count, (link[2] << 8) | link[3]);
+        if (ascii) {
+            len = flex_text_decode(&text, data, 252, out);
+            if (len && fwrite(out, len, 1, outf) != 1) {
+                fprintf(stderr, "%s.%s: write error.\n", d->name, d->ext);
+                exit(1);
+            }
+        } else if (flex_output_add(&output, data, 252) < 0) {
             fprintf(stderr, "%s.%s: write error.\n", d->name, d->ext);
             exit(1);
         }
-    } while(disk_read_next(workbuf));
+        last = link;
+    }
+    if (!ascii && flex_output_flush(&output) < 0) {
+        fprintf(stderr, "%s.%s: write error.\n", d->name, d->ext);
+        exit(1);
+    }
+    if (last == NULL || last[0] || last[1]) {
+        fprintf(stderr, "%s.%s: corrupt sector chain reference (%d,%d)\n", d->name, d->ext,
+            last ? last[0] : d->strack, last ? last[1] : d->ssec);
+        exit(1);
+    }
     return 0;
 }
 
@@ -451,35 +869,213 @@ static int flex_get(const char *name, const char *ext, FILE *outf, int ascii)
     return flex_dump(d, outf, ascii);
 }
 
-static void flex_get_all(void)
-{
-    FILE *outf;
-    char buf[16];
-    dir_begin();
+/* Extract all. The chains are read in up front, many at once through the
+   shared read queue, and each sector is kept as it arrives. Then a pool of
+   workers writes the host files from those copies, each with its own output
+   buffer, so the image is read only once. Binary payloads are gathered with
+   writev() */
+#define GET_BUFSIZE     65536
+
+struct get_job {
+    char name[16];
     int txt;
-    do {
-        struct dir *d = dir_get();
-        if (d->name[0] == 0 || d->name[0] & 0x80)
+    uint8_t *data;          /* The chain's sectors, as read */
+    int nsec;
+    int max;
+    int error;              /* CHAIN_CORRUPT at (track,sec) or CHAIN_LOOP */
+    uint8_t track, sec;
+};
+
+static struct get_job *get_jobs;
+static int get_njobs;
+static atomic_int get_next;
+static atomic_int get_errors;
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+    ssize_t l;
+
+    while (len) {
+        l = write(fd, buf, len);
+        if (l < 0)
+            return -1;
+        buf += l;
+        len -= l;
+    }
+    return 0;
+}
+
+static void *get_worker(void *arg)
+{
+    uint8_t *buf = malloc(GET_BUFSIZE + DECOMP_MAX);
+    FLEX_OUTPUT *out = malloc(sizeof(FLEX_OUTPUT));
+    struct get_job *j;
+    FLEX_TEXT text;
+    uint8_t *p;
+    size_t len;
+    int job, fd, i;
+
+    if (buf == NULL || out == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    while ((job = atomic_fetch_add(&get_next, 1)) < get_njobs) {
+        j = &get_jobs[job];
+        fd = open(j->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            perror(j->name);
+            atomic_fetch_add(&get_errors, 1);
             continue;
-        snprintf(buf, 16, "%.8s.%s.3s", d->name, d->ext);
-        outf = fopen(buf, "w");
-        if (outf == NULL) {
-            perror(buf);
+        }
+        flex_text_init(&text, 0);
+        flex_output_init(out, fd);
+        len = 0;
+        for (i = 0; i < j->nsec; i++) {
+            p = j->data + i * SECTOR_SIZE + 4;
+            /* Binary payloads are written without a copy */
+            if (!j->txt) {
+                if (flex_output_add(out, p, 252) < 0 ||
+                    (i == j->nsec - 1 && flex_output_flush(out) < 0))
+                    break;
+                continue;
+            }
+            len += flex_text_decode(&text, p, 252, buf + len);
+            if (len >= GET_BUFSIZE || i == j->nsec - 1) {
+                if (write_all(fd, buf, len) < 0)
+                    break;
+                len = 0;
+            }
+        }
+        if (i < j->nsec || close(fd) < 0) {
+            perror(j->name);
+            atomic_fetch_add(&get_errors, 1);
+            if (i < j->nsec)
+                close(fd);
+        }
+    }
+    free(out);
+    free(buf);
+    return NULL;
+}
+
+/* Called for each sector as the chains are read in */
+static int get_walk(void *arg, int chain, int track, int sector, const uint8_t *data)
+{
+    struct get_job *j = &get_jobs[chain];
+
+    if (data == NULL) {
+        j->error = CHAIN_CORRUPT;
+        j->track = track;
+        j->sec = sector;
+        return 1;
+    }
+    if (j->nsec == (sir.endTrack + 1) * sir.endSector) {
+        j->error = CHAIN_LOOP;
+        return 1;
+    }
+    if (j->nsec == j->max) {
+        j->max = j->max * 2 + 16;
+        j->data = realloc(j->data, j->max * SECTOR_SIZE);
+        if (j->data == NULL) {
+            fprintf(stderr, "Out of memory.\n");
+            exit(1);
+        }
+    }
+    memcpy(j->data + j->nsec++ * SECTOR_SIZE, data, SECTOR_SIZE);
+    return 0;
+}
+
+static int flex_get_all(void)
+{
+    FLEX_WALK *walk;
+    FLEX_IO io;
+    pthread_t *threads;
+    struct get_job *j;
+    struct dir *d;
+    uint8_t *p;
+    int nthreads;
+    int i, n;
+
+    get_jobs = calloc(dir_nslots, sizeof(struct get_job));
+    walk = calloc(dir_nslots, sizeof(FLEX_WALK));
+    if (get_jobs == NULL || walk == NULL || flex_io_init(&io, FLEX_IO_DEPTH) < 0) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    for (i = 0; i < dir_nslots; i++) {
+        d = dir_slots[i];
+        if (!dir_inuse(d))
             continue;
+        j = &get_jobs[get_njobs];
+        snprintf(j->name, sizeof(j->name), "%.8s.%.3s", d->name, d->ext);
+        j->txt = !memcmp(d->ext, "TXT", 3);
+        walk[get_njobs].img = &disk;
+        walk[get_njobs].track = d->strack;
+        walk[get_njobs].sector = d->ssec;
+        walk[get_njobs].sectors = dir_sectors(d);
+        get_njobs++;
+    }
+
+    /* Read all the chains in with many reads in flight, this is the only
+       pass over the image */
+    if (flex_io_walk(&io, walk, get_njobs, get_walk, NULL) < 0) {
+        fprintf(stderr, "Unable to read the sector chains.\n");
+        exit(1);
+    }
+    flex_io_exit(&io);
+    free(walk);
+
+    /* Report in directory order, any damage fails the extract as it does
+       for a single file */
+    for (i = 0; i < get_njobs; i++) {
+        j = &get_jobs[i];
+        for (n = 0; n < j->nsec; n++) {
+            p = j->data + n * SECTOR_SIZE;
+            if (((p[2] << 8) | p[3]) != n + 1) {
+                fprintf(stderr, "%s: sector %d has a sector count of %d.\n",
+                    j->name, n + 1, (p[2] << 8) | p[3]);
+                atomic_fetch_add(&get_errors, 1);
+            }
         }
-        txt = !memcmp(d->ext, "TXT", 3);
-        flex_dump(d, outf, txt);
-        fclose(outf);
-    } while(dir_next());
+        if (j->error == CHAIN_LOOP)
+            fprintf(stderr, "%s: chain loops.\n", j->name);
+        else if (j->error == CHAIN_CORRUPT)
+            fprintf(stderr, "%s: corrupt sector chain reference (%d,%d)\n",
+                j->name, j->track, j->sec);
+        if (j->error)
+            atomic_fetch_add(&get_errors, 1);
+    }
+
+    nthreads = pool_threads(get_njobs);
+    threads = calloc(nthreads, sizeof(pthread_t));
+    if (threads == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    atomic_store(&get_next, 0);
+    for (i = 1; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, get_worker, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    get_worker(NULL);
+    for (i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    for (i = 0; i < get_njobs; i++)
+        free(get_jobs[i].data);
+    free(get_jobs);
+    return atomic_load(&get_errors) ? -1 : 0;
 }
 
 static void flex_ls(void)
 {
     struct dir *d;
     printf("Volume: %-11.11s   (%02d/%02d/%02d)\n",
-        sir.label, sir.day, sir.month, sir.year);
+        sir.volLabel, sir.dateDay, sir.dateMonth, sir.dateYear);
     printf("Media format %d tracks, %d sectors per track.\n",
-        sir.endtrack+1, sir.endsector);
+        sir.endTrack+1, sir.endSector);
     dir_begin();
     do {
         d = dir_get();
@@ -495,28 +1091,18 @@ static void flex_ls(void)
 static void flex_showmap(void)
 {
     int t, s;
-    uint16_t *p;
+    int pos = 0;
 
     flex_buildmap();
-    
-    p = flex_map;
 
-    for (t = 0; t <= sir.endtrack; t++) {
-        for (s = 0; s < sir.endsector - 1; s++) {
-            switch(*p++) {
-                case 0xFFFF:
-                    putchar('.');
-                    break;
-                case 0xFFFE:
-                    putchar('-');
-                    break;
-                case 0x0001:
-                    putchar('F');
-                    break;
-                default:
-                    putchar('?');
-                    break;
-            }
+    for (t = 0; t <= sir.endTrack; t++) {
+        for (s = 0; s < sir.endSector; s++, pos++) {
+            if (!map_test(pos))
+                putchar('.');
+            else if (flex_owner[pos] == OWNER_FREE)
+                putchar('-');
+            else
+                putchar('F');
         }
         putchar('\n');
     }
@@ -532,6 +1118,12 @@ static void usage(void)
     fprintf(stderr, "-l disk.dsk                     : list contents of disk.\n");
     fprintf(stderr, "-m disk.dsk                     : check disk and show map.\n");
     fprintf(stderr, "-p disk.dsik file.ext linuxfile : put a file.\n");
+    fprintf(stderr, "-p [-A] disk.dsk linuxfile ...  : put files named after the linux files.\n");
+    fprintf(stderr, "-p [-A] disk.dsk @manifest      : put the files listed in manifest,\n");
+    fprintf(stderr, "                                  one 'linuxfile [file.ext]' per line.\n");
+    fprintf(stderr, "   (-A is needed to put exactly two linux files.)\n");
+    fprintf(stderr, "-s: sync the image to disk after a put.\n");
+    fprintf(stderr, "-j threads: number of threads used by -m and -g -A.\n");
     exit(1);
 }
 
@@ -551,10 +1143,12 @@ int main(int argc, char *argv[])
     enum command cmd = LIST;
     char *ext;
     char *name;
+    int batch = 0;
+    int i;
 
     assert(sizeof(struct dir) == 24);
     
-    while((opt = getopt(argc, argv, "lgmpdaA")) != -1) {
+    while((opt = getopt(argc, argv, "lgmpdaAsj:")) != -1) {
         switch(opt) {
         case 'l':
             cmd = LIST;
@@ -577,21 +1171,40 @@ int main(int argc, char *argv[])
         case 'A':
             all = 1;
             break;
+        case 's':
+            sync_image = 1;
+            break;
+        case 'j':
+            check_threads = atoi(optarg);
+            break;
         default:
             usage();
         }
     }
-    if (all && cmd != GET) {
-        fprintf(stderr, "flexfs: -A only supported with -g.\n");
+    if (all && cmd != GET && cmd != PUT) {
+        fprintf(stderr, "flexfs: -A only supported with -g and -p.\n");
         exit(1);
     }
-    if (cmd == LIST || cmd == MAP || all == 1 ) {
+    /* Two names after the disk is the single file.ext linuxfile form */
+    if (cmd == PUT && (all || optind + 3 != argc))
+        batch = 1;
+    if (batch) {
+        if (optind + 2 > argc)
+            usage();
+        for (i = optind + 1; i < argc; i++) {
+            if (argv[i][0] == '@')
+                put_manifest(argv[i] + 1);
+            else
+                put_add(argv[i], NULL);
+        }
+    } else if (cmd == LIST || cmd == MAP || all == 1 ) {
         if (optind + 1 != argc)
             usage();
     } else {
-        if (cmd == DELETE && optind + 2 != argc)
-            usage();
-        else if (optind + 3 != argc)
+        if (cmd == DELETE) {
+            if (optind + 2 != argc)
+                usage();
+        } else if (optind + 3 != argc)
             usage();
         name = argv[optind + 1];
         ext = strchr(name, '.');
@@ -601,23 +1214,23 @@ int main(int argc, char *argv[])
             ext = "";
     }
 
-    disk_fd = open(argv[optind], O_RDWR);
-    if (disk_fd == -1) {
-        perror(argv[optind]);
+    if (flex_image_open(&disk, argv[optind],
+                        (cmd == PUT || cmd == DELETE) ? FLEX_RDWR : FLEX_RDONLY) < 0)
         exit(1);
-    }
     if (flex_mount() < 0) {
         fprintf(stderr, "%s: not a FLEX volume.\n", argv[optind]);
         exit(1);
     }
+    dir_index();
     switch(cmd) {
         case LIST:
             flex_ls();
             break;
         case GET:
-            if (all)
-                flex_get_all();
-            else {
+            if (all) {
+                if (flex_get_all() < 0)
+                    exit(1);
+            } else {
                 FILE *fp = fopen(argv[optind + 2], "w");
                 if (fp == NULL) {
                     perror(argv[optind + 2]);
@@ -631,18 +1244,13 @@ int main(int argc, char *argv[])
             }
             break;
         case PUT:
-            {
-                FILE *fp = fopen(argv[optind + 2], "r");
-                if (fp == NULL) {
-                    perror(argv[optind + 2]);
-                    exit(1);
-                }
-                flex_addfile(name, ext, fp);
-                if (fclose(fp) < 0) {
-                    perror(argv[optind + 2]);
-                    exit(1);
-                }
+            if (!batch) {
+                put_add(argv[optind + 2], NULL);
+                snprintf(put_files[0].name, sizeof(put_files[0].name), "%.8s", name);
+                snprintf(put_files[0].ext, sizeof(put_files[0].ext), "%.3s", ext);
             }
+            if (flex_putfiles() < 0)
+                exit(1);
             break;
         case DELETE:
             flex_unlink(name, ext);
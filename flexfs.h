@@ -1,6 +1,10 @@
 #ifndef FLEXFS_H
 #define FLEXFS_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
 #define SECTOR_SIZE         256
 #define SIR_SIZE            24      
 #define SIR_OFFSET          16      
@@ -103,7 +107,197 @@ typedef struct{
     uint8_t   dateYear;        // 1 byte --- Date year
 } DIR_struct; // 24 bytes total
 
-#define sir_secfree()	(sir.secfreel + (sir.secfreeh << 8))
+// --- libflexfs: shared image access (libflexfs.c) ---
+
+// Image open modes
+#define FLEX_RDONLY         0       // Read only, shared mapping
+#define FLEX_RDWR           1       // Read/write, stores go straight to the image
+#define FLEX_PRIVATE        2       // Read/write copy-on-write, image untouched
+#define FLEX_PREAD          3       // Read only, not mapped, use flex_image_read()
+
+// An open disk image, mapped into memory
+typedef struct {
+    int       fd;               // Image file descriptor
+    int       mode;             // FLEX_RDONLY, FLEX_RDWR, FLEX_PRIVATE or FLEX_PREAD
+    uint8_t  *base;             // Start of the mapped image (NULL for FLEX_PREAD)
+    size_t    size;             // Image size in bytes
+    uint16_t  tracks;           // Number of tracks (endTrack + 1)
+    uint8_t   sectors;          // Sectors per track (endSector)
+} FLEX_IMAGE;
+
+extern int         flex_image_open(FLEX_IMAGE *img, const char *path, int mode);
+extern void        flex_image_close(FLEX_IMAGE *img);
+extern void        flex_image_geometry(FLEX_IMAGE *img, int tracks, int sectors);
+extern long        flex_image_offset(const FLEX_IMAGE *img, int track, int sector);
+extern uint8_t    *flex_image_sector(const FLEX_IMAGE *img, int track, int sector);
+extern SIR_struct *flex_image_sir(const FLEX_IMAGE *img);
+extern int         flex_image_read(const FLEX_IMAGE *img, int track, int sector, uint8_t *buf);
+extern int         flex_image_map(FLEX_IMAGE *img);
+extern int         flex_image_sync(FLEX_IMAGE *img);
+
+// --- libflexfs: chain reader ---
+
+#define FLEX_RUN_MAX        64      // Most sectors read ahead in one go
+
+// Walks a sector chain. On an unmapped image runs of physically consecutive
+// sectors are read ahead with one preadv(), the payloads landing next to
+// each other in data. A mapped image is handed out in place
+typedef struct {
+    const FLEX_IMAGE *img;
+    uint8_t   track, sector;    // Next sector to hand out
+    int       started;          // First sector has been handed out
+    int       count;            // Sectors read ahead
+    int       pos;              // Next of them to hand out
+    int       left;             // Sectors expected still, -1 if unknown
+    int       run;              // Sectors to read ahead at the next jump
+    const uint8_t *linkp[FLEX_RUN_MAX];         // Each sector's link bytes
+    const uint8_t *datap[FLEX_RUN_MAX];         // and payload, in the map or below
+    uint8_t   link[FLEX_RUN_MAX][4];            // Link and record number bytes
+    uint8_t   data[FLEX_RUN_MAX * (SECTOR_SIZE - 4)];
+} FLEX_CHAIN;
+
+extern void        flex_chain_start(FLEX_CHAIN *c, const FLEX_IMAGE *img, int track, int sector, int sectors);
+extern const uint8_t *flex_chain_next(FLEX_CHAIN *c, const uint8_t **data);
+
+// --- libflexfs: gathered output ---
+
+#define FLEX_IOV_MAX        1024    // Slices per writev(), the Linux IOV_MAX
+
+// Slices of memory, usually sector payloads in a mapped image, written to a
+// file descriptor with writev() so they are never copied in user space
+typedef struct {
+    int       fd;
+    int       count;
+    struct iovec iov[FLEX_IOV_MAX];
+} FLEX_OUTPUT;
+
+extern void        flex_output_init(FLEX_OUTPUT *o, int fd);
+extern int         flex_output_add(FLEX_OUTPUT *o, const void *buf, size_t len);
+extern int         flex_output_flush(FLEX_OUTPUT *o);
+
+// --- libflexfs: asynchronous reads ---
+
+#define FLEX_IO_DEPTH       32      // Default reads in flight
+
+// A queue of reads, run through io_uring where the kernel has it and
+// otherwise done synchronously as they are queued
+typedef struct {
+    struct flex_uring *uring;   // NULL for the synchronous fallback
+    unsigned  depth;            // Most reads in flight
+    unsigned  inflight;         // Reads queued and not yet waited for
+    uint64_t *done_tag;         // Synchronous fallback: finished reads
+    int      *done_res;
+    unsigned  done_head;
+} FLEX_IO;
+
+extern int         flex_io_init(FLEX_IO *io, unsigned depth);
+extern void        flex_io_exit(FLEX_IO *io);
+extern int         flex_io_read(FLEX_IO *io, int fd, void *buf, size_t len, long offset, uint64_t tag);
+extern int         flex_io_wait(FLEX_IO *io, uint64_t *tag, int *result);
+
+// One chain for flex_io_walk()
+typedef struct {
+    const FLEX_IMAGE *img;
+    uint8_t   track, sector;    // First sector
+    int       sectors;          // Expected length (from the directory), 0 if unknown
+} FLEX_WALK;
+
+// Called for each sector of a chain in order, data is NULL if the chain
+// runs off the disk or cannot be read. Return non-zero to stop the chain
+typedef int (*flex_walk_fn)(void *arg, int chain, int track, int sector, const uint8_t *data);
+
+extern int         flex_io_walk(FLEX_IO *io, const FLEX_WALK *chains, int n, flex_walk_fn fn, void *arg);
+
+// --- libflexfs: geometry probe ---
+
+// A tracks x sectors layout that fits the image size
+typedef struct {
+    uint16_t  tracks;
+    uint8_t   sectors;
+    uint8_t   confidence;       // 0-100, how well the sector links agree with it
+} FLEX_GEOMETRY;
+
+extern int         flex_image_probe(const FLEX_IMAGE *img, FLEX_GEOMETRY *list, int max);
+
+// --- libflexfs: space compressed text ---
+
+// Conversion flags
+#define FLEX_TEXT_PRINTABLE 1       // Decode: drop control codes, LF, CR LF and LF CR are one newline
+
+// Conversion state, carried from one block to the next
+typedef struct {
+    uint8_t   flags;            // FLEX_TEXT_ flags
+    uint8_t   space;            // Decode: last block ended on 0x09, next byte is a count
+    uint8_t   last;             // Last byte seen, pairs CR and LF
+    uint8_t   tabs;             // Encode: tab stop width (1-127)
+    uint8_t   spaces;           // Encode: spaces not written out yet (under 127)
+    uint32_t  column;           // Encode: output column, for tab stops
+} FLEX_TEXT;
+
+// Largest output of decoding len bytes (every pair 0x09 255, plus a carried count)
+#define FLEX_TEXT_MAX(len)  (255 + ((len) / 2) * 255 + ((len) & 1))
+// Largest output of encoding len bytes, including the final flush
+#define FLEX_TEXT_ENC_MAX(len) (2 * (len) + 2)
+
+extern void        flex_text_init(FLEX_TEXT *t, int flags);
+extern size_t      flex_text_decode(FLEX_TEXT *t, const uint8_t *in, size_t len, uint8_t *out);
+extern void        flex_text_encode_init(FLEX_TEXT *t, int tabs);
+extern size_t      flex_text_encode(FLEX_TEXT *t, const uint8_t *in, size_t len, uint8_t *out);
+extern size_t      flex_text_encode_end(FLEX_TEXT *t, uint8_t *out);
+
+// --- libflexfs: pattern search ---
+
+#define FLEX_SEARCH_MAX     256     // Longest pattern, in bytes
+
+// A byte pattern with wildcards and every place it matches in an image.
+// Zero it before the first flex_search_parse()
+typedef struct {
+    uint8_t   byte[FLEX_SEARCH_MAX];
+    uint8_t   fixed[FLEX_SEARCH_MAX];   // 1 where the byte must match, 0 for a wildcard
+    size_t    len;
+    size_t    anchor;           // Fixed byte that candidates are found by
+    size_t   *match;            // Offset of every match, ascending
+    size_t    count, cap;
+} FLEX_SEARCH;
+
+extern int         flex_search_parse(FLEX_SEARCH *s, const char *text);
+extern long        flex_search_run(FLEX_SEARCH *s, const uint8_t *base, size_t size);
+extern size_t      flex_search_find(const FLEX_SEARCH *s, size_t offset);
+extern size_t      flex_search_seek(const FLEX_SEARCH *s, size_t offset, int dir);
+extern void        flex_search_free(FLEX_SEARCH *s);
+
+// --- libflexfs: sector index ---
+
+// Owners of sectors that are not in a file
+#define FLEX_OWNER_NONE     -1      // In no chain
+#define FLEX_OWNER_FREE     -2      // On the free chain
+#define FLEX_OWNER_DIR      -3      // Directory
+#define FLEX_OWNER_SYSTEM   -4      // Boot sectors and SIR (T0 S1-S4)
+
+// Predecessors of sectors nothing (or more than one thing) links to
+#define FLEX_PREV_NONE      -1
+#define FLEX_PREV_MANY      -2
+
+// Who owns each sector and which sector links to it, indexed by
+// offset / SECTOR_SIZE. Built once from the link bytes of a mapped image
+typedef struct {
+    long      count;            // Sectors in the image
+    int32_t  *prev;             // Sector linking here, or FLEX_PREV_
+    int32_t  *owner;            // Index into files, or FLEX_OWNER_
+    int       nfiles;
+    struct flex_index_file {
+        char      name[13];     // NAME.EXT
+        uint8_t   track, sector;            // First sector
+    } *files;
+} FLEX_INDEX;
+
+extern int         flex_index_build(FLEX_INDEX *x, const FLEX_IMAGE *img);
+extern void        flex_index_free(FLEX_INDEX *x);
+extern const char *flex_index_owner(const FLEX_INDEX *x, long offset);
+extern long        flex_index_step(const FLEX_INDEX *x, const FLEX_IMAGE *img, long offset, int dir);
+extern long        flex_index_start(const FLEX_INDEX *x, const FLEX_IMAGE *img, long offset);
+
+#define sir_secfree()	(sir.freeSectorsLo + (sir.freeSectorsHi << 8))
 #define dir_sectors(d)	(((d)->sech << 8) + ((d)->secl))
 
 #endif // FLEXFS_H
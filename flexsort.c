@@ -9,69 +9,47 @@
 // --- Disk/Sector Constants ---
 typedef unsigned char u_byte;
 
-// @FIXME: sorts okay but messes up the dir next_* links
 #define PROGRAM_VERSION     "1.1.6"
 
 #include "flexfs.h"
 
 // --- Global Disk Info ---
-uint8_t  SIR_buffer[SECTOR_SIZE];
+FLEX_IMAGE disk;
+uint8_t *SIR_buffer;
 uint16_t track_count;
 uint8_t  sectors_per_track;
 
-// --- Utility Functions ---
+// Directory sectors, in chain order
+typedef struct {
+    uint8_t  track;
+    uint8_t  sector;
+    uint8_t *data;
+} DIR_SECTOR;
 
-/**
- * @brief Reads a sector from the disk image.
- */
-int read_sector(FILE *disk_file, uint16_t track, uint8_t sector, uint8_t *buffer) {
-    if (track >= track_count || sector > sectors_per_track || sector == 0) {
-        return -1;
-    }
-    
-    // Offset calculation: (Track * SectorsPerTrack + (Sector - 1)) * SectorSize
-    long offset = (long)track * sectors_per_track * SECTOR_SIZE + (long)(sector - 1) * SECTOR_SIZE;
-    if (fseek(disk_file, offset, SEEK_SET) != 0) {
-        return -1;
-    }
-    if (fread(buffer, 1, SECTOR_SIZE, disk_file) != SECTOR_SIZE) {
-        return -1;
-    }
-    return 0;
-}
+DIR_SECTOR *dir_chain;
+int         dir_chain_len;
+
+// --- Utility Functions ---
 
 /**
- * @brief Writes a sector to the disk image.
+ * @brief Returns a sector of the mapped disk image, NULL if out of range.
  */
-int write_sector(FILE *disk_file, uint16_t track, uint8_t sector, const uint8_t *buffer) {
+uint8_t *get_sector(uint16_t track, uint8_t sector) {
     if (track >= track_count || sector > sectors_per_track || sector == 0) {
-        return -1;
-    }
-
-    long offset = (long)track * sectors_per_track * SECTOR_SIZE + (long)(sector - 1) * SECTOR_SIZE;
-    if (fseek(disk_file, offset, SEEK_SET) != 0) {
-        return -1;
-    }
-    if (fwrite(buffer, 1, SECTOR_SIZE, disk_file) != SECTOR_SIZE) {
-        return -1;
+        return NULL;
     }
-    return 0;
+    return flex_image_sector(&disk, track, sector);
 }
 
 /**
  * @brief Reads the SIR and sets global disk parameters.
  */
-int init_disk_info(FILE *disk_file) {
+int init_disk_info(void) {
     // We must read S3 to get sectors_per_track for later calculations.
-    uint8_t temp_buffer[SECTOR_SIZE];
-    long sir_offset = (long)0 * 0 * SECTOR_SIZE + (long)(3 - 1) * SECTOR_SIZE; 
-    
-    if (fseek(disk_file, sir_offset, SEEK_SET) != 0) return -1;
-    if (fread(temp_buffer, 1, SECTOR_SIZE, disk_file) != SECTOR_SIZE) return -1;
-    
-    memcpy(SIR_buffer, temp_buffer, SECTOR_SIZE);
+    SIR_struct *sir = flex_image_sir(&disk);
+    if (sir == NULL) return -1;
 
-    SIR_struct *sir = (SIR_struct *)(SIR_buffer + SIR_OFFSET);
+    SIR_buffer = (uint8_t *)sir - SIR_OFFSET;
     
     sectors_per_track = sir->endSector;
     track_count = sir->endTrack + 1;
@@ -107,37 +85,47 @@ int compare_dir_entries(const void *a, const void *b) {
 
 /**
  * @brief Reads all directory entries by following the sector linkage chain.
- * Traverses the directory chain using Bytes 0-1 of each sector.
- * @param disk_file File pointer.
+ * Traverses the directory chain using Bytes 0-1 of each sector, caching the
+ * chain in dir_chain so it is only walked once. A link off the disk ends the
+ * chain (older flexdsk images linked the last directory sector past the
+ * end of track 0).
  * @param active_entries Output array of active DIR_structs.
  * @return Total count of active entries.
  */
-int read_directory(FILE *disk_file, DIR_struct **active_entries) {
+int read_directory(DIR_struct **active_entries) {
     uint8_t current_track = DIR_START_TRACK;
     uint8_t current_sector = DIR_START_SECTOR;
-    // Estimate max possible entries for initial allocation
-    int max_entries_possible = (sectors_per_track - (DIR_START_SECTOR - 1)) * DIR_ENTRIES_PER_SECTOR; 
-    
-    DIR_struct *entries = (DIR_struct *)malloc(max_entries_possible * sizeof(DIR_struct));
-    if (!entries) {
+    int max_sectors = track_count * sectors_per_track;
+    int active_count = 0;
+    uint8_t *sector_buffer;
+
+    // Every sector of the chain can hold DIR_ENTRIES_PER_SECTOR entries
+    dir_chain = (DIR_SECTOR *)malloc(max_sectors * sizeof(DIR_SECTOR));
+    DIR_struct *entries = (DIR_struct *)malloc(max_sectors * DIR_ENTRIES_PER_SECTOR * sizeof(DIR_struct));
+    if (!dir_chain || !entries) {
         perror("Error allocating memory for directory entries");
+        free(entries);
         return -1;
     }
 
-    int active_count = 0;
-    uint8_t sector_buffer[SECTOR_SIZE];
-    
     // Iterate through the directory chain by following links (T0 S0 is end-of-chain)
     while (current_track != 0 || current_sector != 0) {
-        if (read_sector(disk_file, current_track, current_sector, sector_buffer) != 0) {
-            fprintf(stderr, "Error reading directory chain link T%d S%d. Stopping read.\n", current_track, current_sector);
+        if ((sector_buffer = get_sector(current_track, current_sector)) == NULL) {
+            if (dir_chain_len == 0) {
+                fprintf(stderr, "Error reading directory chain link T%d S%d. Stopping read.\n", current_track, current_sector);
+                free(entries);
+                return -1;
+            }
+            break;
+        }
+        if (dir_chain_len == max_sectors) {
+            fprintf(stderr, "Error: Directory chain loops back on itself.\n");
             free(entries);
             return -1;
         }
-
-        // The link to the next sector is in bytes 0 and 1
-        uint8_t next_track = sector_buffer[0];
-        uint8_t next_sector = sector_buffer[1];
+        dir_chain[dir_chain_len].track = current_track;
+        dir_chain[dir_chain_len].sector = current_sector;
+        dir_chain[dir_chain_len++].data = sector_buffer;
 
         // Extract 10 directory entries from offset 16
         for (int i = 0; i < DIR_ENTRIES_PER_SECTOR; i++) {
@@ -146,116 +134,118 @@ int read_directory(FILE *disk_file, DIR_struct **active_entries) {
             
             // Check file status: not unused (0x00) and not deleted (MSB set)
             if (dir_ptr->fileName[0] != 0x00 && !(dir_ptr->fileName[0] & 0x80)) {
-                if (active_count < max_entries_possible) {
-                    memcpy(&entries[active_count], dir_ptr, DIR_ENTRY_SIZE);
-                    active_count++;
-                } else {
-                    fprintf(stderr, "Warning: Maximum directory capacity reached during read. Some files may be skipped.\n");
-                    goto cleanup;
-                }
+                memcpy(&entries[active_count], dir_ptr, DIR_ENTRY_SIZE);
+                active_count++;
             }
         }
         
-        // Move to the next sector in the chain
-        current_track = next_track;
-        current_sector = next_sector;
+        // Move to the next sector in the chain (bytes 0 and 1)
+        current_track = sector_buffer[0];
+        current_sector = sector_buffer[1];
     }
 
-cleanup:
     // Shrink the memory block to the actual count of active entries
-    *active_entries = (DIR_struct *)realloc(entries, active_count * sizeof(DIR_struct));
+    *active_entries = (DIR_struct *)realloc(entries, (active_count ? active_count : 1) * sizeof(DIR_struct));
     
     return active_count;
 }
 
 /**
- * @brief Writes the sorted/repacked directory back to the disk, following the original chain.
- * @param disk_file File pointer.
+ * @brief Writes the sorted/repacked directory back over the cached chain.
+ * The new contents of each directory sector are built in memory and only
+ * the sectors whose 240 bytes of entries differ are written. The chain
+ * links are left as they are, empty directory sectors stay in the chain.
  * @param entries Array of DIR_structs to write.
  * @param count Number of entries to write.
- * @return 0 on success, -1 on failure.
+ * @return Number of sectors written, -1 on failure.
  */
-int write_directory(FILE *disk_file, const DIR_struct *entries, int count) {
-    uint8_t current_track = DIR_START_TRACK;
-    uint8_t current_sector = DIR_START_SECTOR;
+int write_directory(const DIR_struct *entries, int count) {
+    uint8_t payload[DIR_ENTRIES_PER_SECTOR * DIR_ENTRY_SIZE];
     int entry_index = 0;
-    uint8_t sector_buffer[SECTOR_SIZE];
+    int written = 0;
+
+    for (int k = 0; k < dir_chain_len; k++) {
+        int n = count - entry_index;
+
+        if (n > DIR_ENTRIES_PER_SECTOR)
+            n = DIR_ENTRIES_PER_SECTOR;
+        // Unused entries are marked 0x00
+        memset(payload, 0, sizeof(payload));
+        if (n > 0) {
+            memcpy(payload, &entries[entry_index], n * DIR_ENTRY_SIZE);
+            entry_index += n;
+        }
+        if (memcmp(dir_chain[k].data + 16, payload, sizeof(payload)) != 0) {
+            memcpy(dir_chain[k].data + 16, payload, sizeof(payload));
+            written++;
+        }
+    }
 
-    // Read the link for the starting sector (T0, S5) once
-    if (read_sector(disk_file, DIR_START_TRACK, DIR_START_SECTOR, sector_buffer) != 0) {
-        fprintf(stderr, "Error: Could not read starting directory sector T%d S%d.\n", current_track, current_sector);
+    if (entry_index < count) {
+        fprintf(stderr, "Error: Directory chain is too short! Could not write %d file(s).\n", count - entry_index);
         return -1;
     }
-    
-    // Initial next link read from T0, S5
-    uint8_t next_track = sector_buffer[0];
-    uint8_t next_sector = sector_buffer[1];
 
-    // Traverse the original chain and overwrite with new data
-    while (current_track != 0 || current_sector != 0) {
-        uint8_t sector_to_write_track = current_track;
-        uint8_t sector_to_write_sector = current_sector;
-        
-        // 1. For sectors after the first one, we must read the link from the disk *before* writing over it.
-        // We defer this read until the end of the previous loop iteration in the 'Move' step.
-        
-        // 2. Prepare the new sector buffer: zero everything
-        // This ensures unused entries are marked 0x00
-        memset(sector_buffer, 0, SECTOR_SIZE);
+    return written;
+}
 
-        // 3. Populate directory entries
-        for (int i = 0; i < DIR_ENTRIES_PER_SECTOR; i++) {
-            size_t offset = 16 + (i * DIR_ENTRY_SIZE);
-            if (entry_index < count) {
-                // Copy active entry
-                memcpy(sector_buffer + offset, &entries[entry_index], DIR_ENTRY_SIZE);
-                entry_index++;
-            } else {
-                // All active files have been written. Stop populating.
-                break; 
-            }
-        }
-        
-        // 4. Write the link back to the buffer (Bytes 0-1)
-        if (entry_index < count) {
-             // If there are still entries to write, the link should point to the next sector in the original chain
-             sector_buffer[0] = next_track; 
-             sector_buffer[1] = next_sector;
-        } else {
-             // If all entries are written, the directory chain ends here.
-             sector_buffer[0] = 0; 
-             sector_buffer[1] = 0;
-             next_track = 0; // Ensures the loop terminates after this write
-             next_sector = 0;
-        }
-        
-        // 5. Write the repacked sector back
-        if (write_sector(disk_file, sector_to_write_track, sector_to_write_sector, sector_buffer) != 0) {
-            fprintf(stderr, "Error: Failed to write repacked directory sector T%d S%d.\n", sector_to_write_track, sector_to_write_sector);
-            return -1;
-        }
+/**
+ * @brief Cuts empty directory sectors beyond track 0 off the end of the
+ * repacked chain and appends them to the tail of the SIR free chain.
+ * Track 0 directory sectors always stay in the directory.
+ * @param count Number of active entries written by write_directory().
+ * @return Number of sectors returned to the free chain, -1 on failure.
+ */
+int compact_directory(int count) {
+    SIR_struct *sir = (SIR_struct *)(SIR_buffer + SIR_OFFSET);
+    int keep = (count + DIR_ENTRIES_PER_SECTOR - 1) / DIR_ENTRIES_PER_SECTOR;
+    uint8_t *tail;
 
-        // 6. Move to the next sector in the chain
-        current_track = next_track;
-        current_sector = next_sector;
-        
-        // 7. If we are moving to the next sector (and not exiting), read its link for the *next* iteration
-        if (current_track != 0 || current_sector != 0) {
-            if (read_sector(disk_file, current_track, current_sector, sector_buffer) != 0) {
-                fprintf(stderr, "Error: Could not read original directory sector T%d S%d to find next link.\n", current_track, current_sector);
-                return -1;
-            }
-            next_track = sector_buffer[0];
-            next_sector = sector_buffer[1];
-        }
+    if (keep < 1) keep = 1;
+    // Never release a track 0 sector, whatever its place in the chain
+    for (int k = keep; k < dir_chain_len; k++) {
+        if (dir_chain[k].track == DIR_START_TRACK) keep = k + 1;
     }
+    if (keep >= dir_chain_len) return 0;
 
-    if (entry_index < count) {
-        fprintf(stderr, "Error: Directory chain is too short! Could not write %d file(s).\n", count - entry_index);
-        return -1;
+    int released = dir_chain_len - keep;
+    uint16_t free_sectors = (sir->freeSectorsHi << 8) | sir->freeSectorsLo;
+
+    // Link the released sectors to each other and clear them
+    for (int k = keep; k < dir_chain_len; k++) {
+        uint8_t *p = dir_chain[k].data;
+        memset(p, 0, SECTOR_SIZE);
+        if (k + 1 < dir_chain_len) {
+            p[0] = dir_chain[k + 1].track;
+            p[1] = dir_chain[k + 1].sector;
+        }
     }
 
-    return 0;
+    // Hook them onto the end of the free chain (or start it, if empty)
+    if (sir->lastFreeTrack == 0 && sir->lastFreeSector == 0) {
+        sir->firstFreeTrack = dir_chain[keep].track;
+        sir->firstFreeSector = dir_chain[keep].sector;
+    } else {
+        if ((tail = get_sector(sir->lastFreeTrack, sir->lastFreeSector)) == NULL) {
+            fprintf(stderr, "Error: Free chain ends outside the disk (T%d S%d).\n",
+                    sir->lastFreeTrack, sir->lastFreeSector);
+            return -1;
+        }
+        tail[0] = dir_chain[keep].track;
+        tail[1] = dir_chain[keep].sector;
+    }
+    sir->lastFreeTrack = dir_chain[dir_chain_len - 1].track;
+    sir->lastFreeSector = dir_chain[dir_chain_len - 1].sector;
+    free_sectors += released;
+    sir->freeSectorsHi = free_sectors >> 8;
+    sir->freeSectorsLo = free_sectors & 0xFF;
+
+    // The directory now ends at the last sector kept
+    dir_chain[keep - 1].data[0] = 0;
+    dir_chain[keep - 1].data[1] = 0;
+    dir_chain_len = keep;
+
+    return released;
 }
 
 /**
@@ -319,8 +309,9 @@ void display_results(const DIR_struct *entries, int count) {
 
 void print_usage(const char *prog_name) {
     fprintf(stderr, "flexsort version %s\n", PROGRAM_VERSION);
-    fprintf(stderr, "Usage: %s <disk_image_file> [-a]\n", prog_name);
+    fprintf(stderr, "Usage: %s <disk_image_file> [-a] [-c]\n", prog_name);
     fprintf(stderr, "  -a: Sort all active directory entries alphabetically by filename/extension.\n");
+    fprintf(stderr, "  -c: Compact the directory, returning empty sectors beyond track 0 to the free chain.\n");
 }
 
 // --- Main Function ---
@@ -333,34 +324,38 @@ int main(int argc, char *argv[]) {
     
     const char *disk_path = argv[1];
     int sort_flag = 0;
+    int compact_flag = 0;
     
-    if (argc == 3 && strcmp(argv[2], "-a") == 0) {
-        sort_flag = 1;
-    } else if (argc > 3 || (argc == 2 && argv[1][0] == '-')) {
-        print_usage(argv[0]);
-        return 1;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "-a") == 0) {
+            sort_flag = 1;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            compact_flag = 1;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
     }
 
     // --- 1. Open Disk Image ---
-    FILE *disk_file = fopen(disk_path, "r+b"); 
-    if (!disk_file) {
-        perror("Error opening disk image file");
+    if (flex_image_open(&disk, disk_path, FLEX_RDWR) != 0) {
+        fprintf(stderr, "Error opening disk image file\n");
         return 1;
     }
 
     // --- 2. Initialize Disk Info ---
-    if (init_disk_info(disk_file) != 0) {
-        fclose(disk_file);
+    if (init_disk_info() != 0) {
+        flex_image_close(&disk);
         return 1;
     }
 
     // --- 3. Read and Filter Directory Entries ---
     DIR_struct *active_entries = NULL;
-    int active_count = read_directory(disk_file, &active_entries);
+    int active_count = read_directory(&active_entries);
 
     if (active_count < 0) {
         // Error handling for allocation failure in read_directory
-        fclose(disk_file);
+        flex_image_close(&disk);
         return 1;
     }
     
@@ -373,20 +368,35 @@ int main(int argc, char *argv[]) {
     }
 
     // --- 5. Repack and Write Directory ---
-    if (write_directory(disk_file, active_entries, active_count) != 0) {
+    int written = write_directory(active_entries, active_count);
+    if (written < 0) {
         fprintf(stderr, "Error: Failed to write repacked directory.\n");
         free(active_entries);
-        fclose(disk_file);
+        flex_image_close(&disk);
         return 1;
     }
-    printf("Directory successfully repacked and written back to '%s'.\n", disk_path);
+    printf("Directory successfully repacked and written back to '%s' (%d of %d sectors changed).\n",
+           disk_path, written, dir_chain_len);
+
+    if (compact_flag) {
+        int released = compact_directory(active_count);
+        if (released < 0) {
+            fprintf(stderr, "Error: Failed to compact directory.\n");
+            free(active_entries);
+            free(dir_chain);
+            flex_image_close(&disk);
+            return 1;
+        }
+        printf("Directory compacted, %d sector(s) returned to the free chain.\n", released);
+    }
 
     // --- 6. Display Results ---
     display_results(active_entries, active_count);
 
     // --- 7. Cleanup ---
     free(active_entries);
-    fclose(disk_file);
+    free(dir_chain);
+    flex_image_close(&disk);
 
     return 0;
 }
@@ -10,121 +10,79 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "flexfs.h"
+
 typedef unsigned char u_byte;
 typedef unsigned char bool;
 
 #define true 1
 #define false 0
 
-/*
- * FLEX sector size
- */
-#define SECTOR_SIZE 256
-
 /*
  * Global variables
  */
-u_byte *dskFileData;
+FLEX_IMAGE dskImage = { .fd = -1 };
 int dskFileSize;
 int dskTracks;
 int dskSectors;
-u_byte sector[SECTOR_SIZE];
-
-/*
- * Definition of SIR sector structure
- */
-#define SIR_SECTOR_PADDING 16
-typedef struct{
-    u_byte volLabel[11];        // 0 - 10
-    u_byte volNumberHi;         /* 11-12 */
-    u_byte volNumberLo;
-    u_byte firstFreeTrack;
-    u_byte firstFreeSector;
-    u_byte lastFreeTrack;
-    u_byte lastFreeSector;
-    u_byte freeSectorsHi;
-    u_byte freeSectorsLo;
-    u_byte dateMonth;
-    u_byte dateDay;
-    u_byte dateYear;
-    u_byte endTrack;
-    u_byte endSector;
-} SIR_struct;
+u_byte *sector;
 
 /*
- * Definition of directory entry
+ * SIR_struct and DIR_struct come from flexfs.h
  */
+#define SIR_SECTOR_PADDING SIR_OFFSET
 #define DIR_SECTOR_PADDING 16
-typedef struct{
-    u_byte fileName[8];
-    u_byte fileExt[3];
-    u_byte unused1;
-    u_byte unused2;
-    u_byte startTrack;
-    u_byte startSector;
-    u_byte endTrack;
-    u_byte endSector;
-    u_byte totalSectorsHi;
-    u_byte totalSectorsLo;
-    u_byte randomFileFlag;
-    u_byte unused3;
-    u_byte dateMonth;
-    u_byte dateDay;
-    u_byte dateYear;
-} DIR_struct;
 
 /*
  * Cleanly exit program
  */
 bool program_exit(int rc){
-    free(dskFileData);
+    flex_image_close(&dskImage);
     exit(rc);
 }
 
+/*
+ * Take the image structure from the SIR when it matches the file size.
+ * This needs nothing but the SIR, so the image does not have to be mapped
+ */
+bool sirGeometry(){
+    if(dskImage.sectors < MIN_SECTORS)
+        return false;
+    if((long)dskImage.tracks*dskImage.sectors*SECTOR_SIZE != dskFileSize)
+        return false;
+    dskTracks = dskImage.tracks;
+    dskSectors = dskImage.sectors;
+    return true;
+}
+
 /*
  * Calculate image structure based on file size, sector size and FLEX linking bytes
  */
-bool calcDiskStructure(){
-    int i, tr, se;
+bool calcDiskStructure(bool debug){
+    FLEX_GEOMETRY geometry[4];
+    int i, n;
 
     // Check if file big enough to be a disk image
     if(dskFileSize < SECTOR_SIZE*10)
         return false;
-  
-    // Method 1 - Follow entire sector chain on disk
-    tr = 0;
-    for(i = SECTOR_SIZE*2; i < dskFileSize; i = i + SECTOR_SIZE){
-        if(dskFileData[i] > tr && dskFileData[i] - tr == 1)
-            tr = dskFileData[i];
-    }
 
-    dskTracks = tr+1;
-    dskSectors = dskFileSize/dskTracks/SECTOR_SIZE;
-
-    if(dskTracks*dskSectors*SECTOR_SIZE == dskFileSize)
-        return true;
-
-    // Method 2 - Find the longest consecutive sector chain on one track
-    se = 0;
-    dskSectors = 0;
-    for(i = SECTOR_SIZE*2; i < dskFileSize - SECTOR_SIZE; i = i + SECTOR_SIZE){
-        if(dskFileData[i+1] == se + 1)
-            se++;
-        else if(se > dskSectors){
-            dskSectors = se;
-            se = 0;
-        }
+    // Method 1 - Rank the layouts that fit the file size by their sector links
+    n = flex_image_probe(&dskImage, geometry, 4);
+    if(debug){
+        for(i = 0; i < n; i++)
+            printf("\n  candidate %u tracks, %u sectors/track, %u%% confidence",
+                   geometry[i].tracks, geometry[i].sectors, geometry[i].confidence);
+        printf("\n");
     }
-
-    if(dskSectors){
-        dskTracks = dskFileSize/dskSectors/SECTOR_SIZE;
-        if(dskTracks*dskSectors*SECTOR_SIZE == dskFileSize)
-            return true;
+    if(n > 0){
+        dskTracks = geometry[0].tracks;
+        dskSectors = geometry[0].sectors;
+        return true;
     }
 
-    // Method 3 - Determine geometry based on SIR information
-    dskTracks  = dskFileData[SECTOR_SIZE*2 + SIR_SECTOR_PADDING + 22]; // SIR[22]
-    dskSectors = dskFileData[SECTOR_SIZE*2 + SIR_SECTOR_PADDING + 23]; // SIR[23]
+    // Method 2 - Determine geometry based on SIR information
+    dskTracks  = dskImage.tracks;
+    dskSectors = dskImage.sectors;
 
     if(dskTracks >= 34 && dskSectors >= 10)
         return true;
@@ -133,13 +91,19 @@ bool calcDiskStructure(){
 }
 
 /*
- * Return a specific sector from the loaded image
+ * Return a specific sector, from the mapping if the image is mapped and
+ * otherwise read into a buffer that the next call reuses
  */
-void readSector(void *data, int track, int sector){
-    if(track < dskTracks && sector <= dskSectors)
-        memcpy(data, &dskFileData[track*dskSectors*SECTOR_SIZE+(sector-1)*SECTOR_SIZE], SECTOR_SIZE);
-    else
-        memset(data,0,SECTOR_SIZE);
+u_byte *readSector(int track, int sector){
+    static u_byte buffer[SECTOR_SIZE];
+    u_byte *data;
+
+    data = flex_image_sector(&dskImage, track, sector);
+    if(data != NULL)
+        return data;
+    if(flex_image_read(&dskImage, track, sector, buffer) != 0)
+        memset(buffer, 0, SECTOR_SIZE);
+    return buffer;
 }
 
 /*
@@ -162,22 +126,6 @@ void printSector(void *data){
     }
 }
 
-/*
- * Calcuate size of given file
- */
-int getFileSize(FILE *fp){
-    int fSize;
-    int oPos; 
-
-    oPos = ftell(fp);
-    fseek(fp,0,SEEK_END);
-
-    fSize = ftell(fp);
-    fseek(fp,oPos,SEEK_SET);
-
-    return fSize;
-}
-
 /*
  * Print FLEX volume label
  */
@@ -241,86 +189,87 @@ bool matchFileName(u_byte *n, u_byte *e, unsigned char *fname){
 /*
  * Export RAW file starting at track/sector
  */
-int exportFile(FILE *outFile, u_byte startTrack, u_byte startSector, bool checkSequence){
-    // Loop through file sector chain
-    int i;
+int exportFile(FILE *outFile, u_byte startTrack, u_byte startSector, int sectors, bool checkSequence){
+    // Loop through file sector chain. The image is mapped so the payloads
+    // can be written straight from it, gathered with writev()
+    FLEX_CHAIN chain;
+    FLEX_OUTPUT output;
+    const u_byte *link, *data;
     int t = startTrack;
     int s = startSector;
     int seq = 1;
 
-    while(1){
-        readSector(&sector,t,s);
+    if(flex_image_map(&dskImage) != 0)
+        program_exit(-1);
+    fflush(outFile);
+    flex_output_init(&output, fileno(outFile));
+    flex_chain_start(&chain, &dskImage, t, s, sectors);
+    while((link = flex_chain_next(&chain, &data)) != NULL){
         // Write sector to file
-        for(i = 4; i < SECTOR_SIZE; i++)
-            fputc(sector[i],outFile);
+        if(flex_output_add(&output, data, SECTOR_SIZE - 4) != 0)
+            break;
         // Prepare for next sector
-        if(t == sector[0] && s == sector[1]) return seq; // Faulty chain?
-        t = sector[0];
-        s = sector[1];
+        if(t == link[0] && s == link[1]) break; // Faulty chain?
+        t = link[0];
+        s = link[1];
         if(t == 0 && s == 0) // End of file?
             break;
         if(checkSequence)
-            if(seq == sector[2]*256+sector[3]) // Verify sector sequence
+            if(seq == link[2]*256+link[3]) // Verify sector sequence
                 seq++;
             else
                 break;
     }
+    if(flex_output_flush(&output) != 0){
+        printf("Unable to write file\n");
+        program_exit(-1);
+    }
     return seq;
 }
 
 /*
  * Export ASCII text file starting at track/sector
  */
-int exportTextFile(FILE *outFile, u_byte startTrack, u_byte startSector, bool checkSequence){
+#define TEXT_BUFFER_SIZE 65536
+
+int exportTextFile(FILE *outFile, u_byte startTrack, u_byte startSector, int sectors, bool checkSequence){
     // Loop through file sector chain
-    int i,j;
     int t = startTrack;
     int s = startSector;
     int seq = 1;
-    u_byte last_char = 0;
-    bool spacecomp = 0;
-
-    while(1){
-        readSector(&sector,t,s);
-        // Write sector to file and parse as text file
-        for(i = 4; i < SECTOR_SIZE; i++){
-            if(spacecomp){
-                for(j = 0; j < sector[i]; j++)
-                    fputs(" ",outFile);
-                spacecomp = 0;
-            }
-            else
-                switch(sector[i]){
-                case 0x0A: // New line
-                    if(last_char != 0x0D)
-                        fputs("\n",outFile);
-                    break;
-                case 0x0D: // New line
-                    if(last_char != 0x0A)
-                        fputs("\n",outFile);
-                    break;
-                case 0x09: // Space compression (0x09+nn = add nn spaces)
-                    spacecomp = 1;
-                    break;
-                default: // Printable ASCII char
-                    if(sector[i] > 0x1F && sector[i] < 0x7F)
-                        fputc(sector[i],outFile);
-                    break;
-                }
-            last_char = sector[i];
+    FLEX_CHAIN chain;
+    const u_byte *link, *data;
+    FLEX_TEXT text;
+    u_byte *buffer = malloc(TEXT_BUFFER_SIZE + FLEX_TEXT_MAX(SECTOR_SIZE - 4));
+    size_t length = 0;
+
+    if(buffer == NULL){
+        printf("Out of memory\n");
+        program_exit(-1);
+    }
+    flex_text_init(&text, FLEX_TEXT_PRINTABLE);
+    flex_chain_start(&chain, &dskImage, t, s, sectors);
+    while((link = flex_chain_next(&chain, &data)) != NULL){
+        // Decode sector into the buffer, written out in large blocks
+        length += flex_text_decode(&text, data, SECTOR_SIZE - 4, buffer + length);
+        if(length >= TEXT_BUFFER_SIZE){
+            fwrite(buffer, length, 1, outFile);
+            length = 0;
         }
         // Prepare for next sector
-        if(t == sector[0] && s == sector[1]) return seq; // Faulty chain?
-        t = sector[0];
-        s = sector[1];
+        if(t == link[0] && s == link[1]) break; // Faulty chain?
+        t = link[0];
+        s = link[1];
         if(t == 0 && s == 0) // End of file?
             break;
         if(checkSequence)
-            if(seq == sector[2]*256+sector[3]) // Verify sector sequence
+            if(seq == link[2]*256+link[3]) // Verify sector sequence
                 seq++;
             else
                 break;
     }
+    fwrite(buffer, length, 1, outFile);
+    free(buffer);
     return seq;
 }
 
@@ -328,8 +277,8 @@ int exportTextFile(FILE *outFile, u_byte startTrack, u_byte startSector, bool ch
  * Program begin here
  */
 int main(int argc, char **argv){
-    FILE *dskFile, *outFile;
-    SIR_struct *sir;
+    FILE *outFile;
+    SIR_struct sirData, *sir;
     DIR_struct *dir;
     bool flag_verbose = true, flag_list = true, flag_onecol = false, flag_extract = false, flag_text = false, flag_debug = false;
 
@@ -379,48 +328,34 @@ int main(int argc, char **argv){
         program_exit(-1);
     }
 
-    if( (dskFile = fopen( argv[1], "rb")) == NULL ){
+    // Open image file, sectors are read as needed
+    if(flex_image_open(&dskImage, argv[1], FLEX_PREAD) != 0){
         printf("Unable to open image file\n");
         program_exit(-1);
     }
-
-    // Read image file
-    dskFileSize = getFileSize(dskFile);
+    dskFileSize = dskImage.size;
 
     if(flag_verbose)
         printf("Image size is %d bytes - ", dskFileSize);
-    dskFileData = (u_byte*)malloc(dskFileSize);
-
-    if(!dskFileData){
-        printf("Unable to allocate memory\n");
-        fclose(dskFile);
-        program_exit(-2);
-    }
-
-    if(fread(dskFileData,1,dskFileSize,dskFile)!=(size_t)dskFileSize){
-        free(dskFileData);
-        printf("Unable to read file\n");
-        fclose(dskFile);
-        program_exit(-2);
-    }
-
-    fclose(dskFile);
 
-    // Determine image file structure
-    if(!calcDiskStructure()){
+    // Determine image file structure, from the SIR if it can be trusted
+    // and otherwise from the sector links
+    if(!sirGeometry() && !calcDiskStructure(flag_debug)){
         printf("Unable to determine image structure\n");
         program_exit(-3);
     }
+    flex_image_geometry(&dskImage, dskTracks, dskSectors);
     if(flag_verbose)
         printf("%u tracks, %u sectors/track\n", dskTracks, dskSectors);
 
     // Read SIR as track 0 sector 3
-    readSector(&sector,0,3);
+    sector = readSector(0,3);
     if(flag_debug){
         printf(" -- Track 0 Sector 3 --\n");
-        printSector(&sector);
+        printSector(sector);
     }
-    sir = (void*)&sector[SIR_SECTOR_PADDING];
+    memcpy(&sirData, &sector[SIR_SECTOR_PADDING], sizeof(sirData));
+    sir = &sirData;
 
     if(flag_list){
         printf("\nVolume label     ");
@@ -443,21 +378,21 @@ int main(int argc, char **argv){
         printf("NAME           START     END        SIZE    DATE       FLAG\n");
 
     while(1) {
-        readSector(&sector,t,s);
+        sector = readSector(t,s);
         if(flag_debug){
             printf(" -- Track %d Sector %d --\n",t,s);
-            printSector(&sector);
+            printSector(sector);
         }
         for(j = 0; j <= SECTOR_SIZE-sizeof(DIR_struct); j = j + sizeof(DIR_struct)){
             dir = (void*)&sector[j+DIR_SECTOR_PADDING];
-            if(dir->fileName[0] != 0xFF && strlen(dir->fileName)){ // Valid directory entry?
-                if(flag_extract && matchFileName(dir->fileName, dir->fileExt, argv[3])){ // Filename match?
+            if((u_byte)dir->fileName[0] != 0xFF && dir->fileName[0]){ // Valid directory entry?
+                if(flag_extract && matchFileName((u_byte *)dir->fileName, (u_byte *)dir->fileExt, (unsigned char *)argv[3])){ // Filename match?
                     file_t = dir->startTrack;
                     file_s = dir->startSector;
                     file_size = dir->totalSectorsHi*SECTOR_SIZE+dir->totalSectorsLo;
                 }
                 if(flag_list || flag_onecol){
-                    printFileName(dir->fileName, dir->fileExt);
+                    printFileName((u_byte *)dir->fileName, (u_byte *)dir->fileExt);
                     if(flag_list)
                         printf("   t%02u s%02u - t%02u s%02u   %#5u   %#3u-%02u-%02u   %02X\n",
                                dir->startTrack, dir->startSector,
@@ -500,9 +435,9 @@ int main(int argc, char **argv){
             }
         }
         if(flag_text)
-            seq = exportTextFile(outFile,file_t,file_s,true);
+            seq = exportTextFile(outFile,file_t,file_s,file_size,true);
         else
-            seq = exportFile(outFile,file_t,file_s,true);
+            seq = exportFile(outFile,file_t,file_s,file_size,true);
         if(outFile != 0 && outFile != stdout)
             fclose(outFile);
         if(flag_verbose)
@@ -0,0 +1,1505 @@
+/*
+ * LIBFLEXFS
+ * Shared FLEX disk image access for the flextools.
+ *
+ * The image is opened once and mapped into memory. Sectors are handed out
+ * as pointers into the mapping so the tools no longer need a seek plus a
+ * read or write for every 256 byte sector they touch.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#if defined(__linux__) && !defined(NO_URING)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "flexfs.h"
+
+/**
+ * @brief Opens a disk image and maps it into memory.
+ * @param img Image handle to fill in.
+ * @param path Path of the disk image file.
+ * @param mode FLEX_RDONLY, FLEX_RDWR, FLEX_PRIVATE or FLEX_PREAD.
+ * @return 0 on success, -1 on failure.
+ *
+ * A FLEX_PREAD image is not mapped at all, sectors are read one at a time
+ * with flex_image_read(). This suits callers that only look at a handful of
+ * sectors of a large image, like a directory listing.
+ *
+ * The geometry is taken from the SIR when the image is large enough to hold
+ * one. Callers that work out the geometry some other way (damaged SIR, user
+ * override) can replace it with flex_image_geometry().
+ */
+int flex_image_open(FLEX_IMAGE *img, const char *path, int mode) {
+    struct stat st;
+    int prot  = PROT_READ;
+    int flags = MAP_SHARED;
+
+    memset(img, 0, sizeof(*img));
+    img->fd   = -1;
+    img->mode = mode;
+
+    img->fd = open(path, mode == FLEX_RDWR ? O_RDWR : O_RDONLY);
+    if (img->fd < 0) {
+        perror(path);
+        return -1;
+    }
+    if (fstat(img->fd, &st) < 0) {
+        perror(path);
+        flex_image_close(img);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "%s: disk image file is empty.\n", path);
+        flex_image_close(img);
+        return -1;
+    }
+    img->size = st.st_size;
+
+    if (mode == FLEX_PREAD) {
+        SIR_struct sir;
+        if (pread(img->fd, &sir, sizeof(sir), 2 * SECTOR_SIZE + SIR_OFFSET) == sizeof(sir)) {
+            img->tracks  = sir.endTrack + 1;
+            img->sectors = sir.endSector;
+        }
+        return 0;
+    }
+
+    if (mode != FLEX_RDONLY)
+        prot |= PROT_WRITE;
+    if (mode == FLEX_PRIVATE)
+        flags = MAP_PRIVATE;
+
+    img->base = mmap(NULL, img->size, prot, flags, img->fd, 0);
+    if (img->base == MAP_FAILED) {
+        img->base = NULL;
+        perror("mmap");
+        flex_image_close(img);
+        return -1;
+    }
+
+    // Default geometry from the SIR (T0 S3)
+    SIR_struct *sir = flex_image_sir(img);
+    if (sir) {
+        img->tracks  = sir->endTrack + 1;
+        img->sectors = sir->endSector;
+    }
+    return 0;
+}
+
+/**
+ * @brief Unmaps and closes a disk image.
+ */
+void flex_image_close(FLEX_IMAGE *img) {
+    if (img->base)
+        munmap(img->base, img->size);
+    if (img->fd >= 0)
+        close(img->fd);
+    img->base = NULL;
+    img->fd   = -1;
+}
+
+/**
+ * @brief Overrides the geometry read from the SIR.
+ */
+void flex_image_geometry(FLEX_IMAGE *img, int tracks, int sectors) {
+    img->tracks  = tracks;
+    img->sectors = sectors;
+}
+
+/**
+ * @brief Converts a track and sector to a byte offset in the image.
+ * @return The offset, or -1 if the sector is outside the disk or the file.
+ */
+long flex_image_offset(const FLEX_IMAGE *img, int track, int sector) {
+    long offset;
+
+    if (track < 0 || track >= img->tracks || sector < 1 || sector > img->sectors)
+        return -1;
+    offset = ((long)track * img->sectors + (sector - 1)) * SECTOR_SIZE;
+    if (offset + SECTOR_SIZE > (long)img->size)
+        return -1;
+    return offset;
+}
+
+/**
+ * @brief Returns a pointer to a sector inside the mapped image.
+ * @return Pointer to the 256 byte sector, or NULL if it is out of range.
+ */
+uint8_t *flex_image_sector(const FLEX_IMAGE *img, int track, int sector) {
+    long offset = flex_image_offset(img, track, sector);
+
+    if (offset < 0 || img->base == NULL)
+        return NULL;
+    return img->base + offset;
+}
+
+/**
+ * @brief Returns a pointer to the SIR (T0 S3 + 16) inside the mapped image.
+ * @return Pointer to the SIR, or NULL if the image is too small to hold one
+ *         or is not mapped.
+ */
+SIR_struct *flex_image_sir(const FLEX_IMAGE *img) {
+    if (img->size < 3 * SECTOR_SIZE || img->base == NULL)
+        return NULL;
+    return (SIR_struct *)(img->base + 2 * SECTOR_SIZE + SIR_OFFSET);
+}
+
+/**
+ * @brief Copies a sector out of the image, mapped or not.
+ * @param buf Buffer of SECTOR_SIZE bytes.
+ * @return 0 on success, -1 if the sector is out of range or cannot be read.
+ */
+int flex_image_read(const FLEX_IMAGE *img, int track, int sector, uint8_t *buf) {
+    long offset = flex_image_offset(img, track, sector);
+
+    if (offset < 0)
+        return -1;
+    if (img->base) {
+        memcpy(buf, img->base + offset, SECTOR_SIZE);
+        return 0;
+    }
+    if (pread(img->fd, buf, SECTOR_SIZE, offset) != SECTOR_SIZE)
+        return -1;
+    return 0;
+}
+
+/**
+ * @brief Maps a FLEX_PREAD image read only, it then works as FLEX_RDONLY.
+ * @return 0 on success (or if already mapped), -1 on failure.
+ */
+int flex_image_map(FLEX_IMAGE *img) {
+    if (img->base)
+        return 0;
+    img->base = mmap(NULL, img->size, PROT_READ, MAP_SHARED, img->fd, 0);
+    if (img->base == MAP_FAILED) {
+        img->base = NULL;
+        perror("mmap");
+        return -1;
+    }
+    img->mode = FLEX_RDONLY;
+    return 0;
+}
+
+/**
+ * @brief Flushes changes in a FLEX_RDWR image to the file.
+ * @return 0 on success, -1 on failure.
+ */
+int flex_image_sync(FLEX_IMAGE *img) {
+    if (img->mode != FLEX_RDWR)
+        return 0;
+    if (msync(img->base, img->size, MS_SYNC) < 0) {
+        perror("msync");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Chain reader. Chains written by flexdsk, flexadd and flexfs are mostly
+ * physically consecutive, so at each jump in the chain the reader guesses
+ * the file carries on in order and reads a run from there with one
+ * preadv(). The run is never longer than the sectors the directory says
+ * are left, and it shrinks to what was used when the chain jumps away
+ * early, growing again while runs are used up. The link bytes go to one
+ * array and the payloads straight into a second, back to back. A mapped
+ * image needs no reads, the run is handed out in place after a hint to
+ * page it in. Sectors are handed out while the links keep agreeing with
+ * the guess; at the first one that does not, the rest of the run is
+ * dropped and the next run starts at the link.
+ */
+
+/**
+ * @brief Starts walking the chain that begins at track/sector.
+ * @param sectors Length of the chain from its directory entry, 0 if unknown.
+ */
+void flex_chain_start(FLEX_CHAIN *c, const FLEX_IMAGE *img, int track, int sector, int sectors) {
+    c->img     = img;
+    c->track   = track;
+    c->sector  = sector;
+    c->started = 0;
+    c->count   = 0;
+    c->pos     = 0;
+    c->left    = sectors > 0 ? sectors : -1;
+    c->run     = FLEX_RUN_MAX;
+}
+
+// Read a run of consecutive sectors from the next one
+static int chain_fill(FLEX_CHAIN *c) {
+    struct iovec iov[2 * FLEX_RUN_MAX];
+    long offset = flex_image_offset(c->img, c->track, c->sector);
+    long start, n, i;
+    ssize_t got;
+
+    if (offset < 0)
+        return -1;
+    n = (c->img->size - offset) / SECTOR_SIZE;
+    if (n > c->run)
+        n = c->run;
+    // A chain longer than its entry says is read a sector at a time
+    if (c->left >= 0 && n > (c->left ? c->left : 1))
+        n = c->left ? c->left : 1;
+    if (c->img->base) {
+        // Mapped, only ask for the run to be paged in
+        start = offset & ~(sysconf(_SC_PAGESIZE) - 1);
+        madvise(c->img->base + start, offset - start + n * SECTOR_SIZE, MADV_WILLNEED);
+        for (i = 0; i < n; i++) {
+            c->linkp[i] = c->img->base + offset + i * SECTOR_SIZE;
+            c->datap[i] = c->linkp[i] + 4;
+        }
+    } else {
+        for (i = 0; i < n; i++) {
+            iov[2 * i].iov_base     = c->link[i];
+            iov[2 * i].iov_len      = 4;
+            iov[2 * i + 1].iov_base = c->data + i * (SECTOR_SIZE - 4);
+            iov[2 * i + 1].iov_len  = SECTOR_SIZE - 4;
+            c->linkp[i] = c->link[i];
+            c->datap[i] = c->data + i * (SECTOR_SIZE - 4);
+        }
+        got = preadv(c->img->fd, iov, 2 * n, offset);
+        if (got < SECTOR_SIZE)
+            return -1;
+        n = got / SECTOR_SIZE;
+    }
+    c->count = n;
+    c->pos   = 0;
+    return 0;
+}
+
+/**
+ * @brief Hands out the next sector of the chain.
+ * @param c Chain being walked.
+ * @param data Set to the 252 byte payload of the sector.
+ * @return The 4 link and record number bytes of the sector, or NULL at the
+ *         end of the chain or if the next sector is off the disk.
+ *
+ * The pointers stay valid until the next call. The caller decides whether
+ * to carry on, a chain that loops never ends by itself.
+ */
+const uint8_t *flex_chain_next(FLEX_CHAIN *c, const uint8_t **data) {
+    const uint8_t *link;
+
+    if (c->started) {
+        // Follow the link of the sector handed out last
+        link = c->linkp[c->pos - 1];
+        if (link[0] == 0 && link[1] == 0)
+            return NULL;
+        // Still in order with the run read ahead?
+        if (c->sector == c->img->sectors) {
+            c->track++;
+            c->sector = 1;
+        } else
+            c->sector++;
+        if (link[0] != c->track || link[1] != c->sector) {
+            // Jumped away early, read no further ahead than was used
+            if (c->pos < c->count)
+                c->run = c->pos;
+            c->track  = link[0];
+            c->sector = link[1];
+            c->count  = 0;
+        } else if (c->pos == c->count) {
+            // Still in order at the end of the run, read more next time
+            if (c->pos == c->run && c->run < FLEX_RUN_MAX)
+                c->run = c->run * 2 > FLEX_RUN_MAX ? FLEX_RUN_MAX : c->run * 2;
+            c->count  = 0;
+        }
+    }
+    if (c->count == 0 && chain_fill(c) < 0)
+        return NULL;
+    c->started = 1;
+    if (c->left > 0)
+        c->left--;
+    *data = c->datap[c->pos];
+    return c->linkp[c->pos++];
+}
+
+/*
+ * Asynchronous reads. Bulk work such as walking every chain of an image
+ * spends its time waiting for one read after another. FLEX_IO keeps up to
+ * depth reads in flight through io_uring, submitting everything queued with
+ * one system call when the caller waits. Where io_uring is missing (old
+ * kernels, seccomp, built with -DNO_URING) or FLEX_SYNC_IO is set in the
+ * environment, reads are done with pread() as they are queued and the
+ * callers cannot tell the difference.
+ */
+#if defined(__linux__) && !defined(NO_URING)
+#define HAVE_URING
+#endif
+
+#ifdef HAVE_URING
+struct flex_uring {
+    int       fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void     *sq_ring, *cq_ring;
+    size_t    sq_size, cq_size, sqes_size;
+    unsigned  pending;          // Queued and not yet submitted
+    // Reads use IORING_OP_READV (Linux 5.1) rather than IORING_OP_READ
+    // (5.6), so each read in flight has an iovec that must outlive it
+    struct iovec *iov;
+    uint64_t *tags;             // Caller's tag for each iovec slot
+    unsigned *free_slot;        // Stack of unused slots
+    unsigned  nfree;
+};
+
+static void uring_free(struct flex_uring *u) {
+    free(u->iov);
+    free(u->tags);
+    free(u->free_slot);
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_size);
+    if (u->sq_ring)
+        munmap(u->sq_ring, u->sq_size);
+    if (u->fd >= 0)
+        close(u->fd);
+    free(u);
+}
+
+static void *uring_map(int fd, size_t size, long long offset) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static int uring_setup(FLEX_IO *io) {
+    struct io_uring_params p;
+    struct flex_uring *u;
+    uint8_t *sq, *cq;
+
+    if (getenv("FLEX_SYNC_IO"))
+        return -1;
+    u = calloc(1, sizeof(*u));
+    if (u == NULL)
+        return -1;
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, io->depth, &p);
+    if (u->fd < 0) {
+        free(u);
+        return -1;
+    }
+
+    u->iov       = malloc(io->depth * sizeof(*u->iov));
+    u->tags      = malloc(io->depth * sizeof(*u->tags));
+    u->free_slot = malloc(io->depth * sizeof(*u->free_slot));
+    if (u->iov == NULL || u->tags == NULL || u->free_slot == NULL) {
+        uring_free(u);
+        return -1;
+    }
+    for (u->nfree = 0; u->nfree < io->depth; u->nfree++)
+        u->free_slot[u->nfree] = io->depth - 1 - u->nfree;
+
+    u->sq_size   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size   = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_size > u->sq_size)
+            u->sq_size = u->cq_size;
+        u->sq_ring = uring_map(u->fd, u->sq_size, IORING_OFF_SQ_RING);
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->sq_ring = uring_map(u->fd, u->sq_size, IORING_OFF_SQ_RING);
+        u->cq_ring = uring_map(u->fd, u->cq_size, IORING_OFF_CQ_RING);
+    }
+    u->sqes = uring_map(u->fd, u->sqes_size, IORING_OFF_SQES);
+    if (u->sq_ring == NULL || u->cq_ring == NULL || u->sqes == NULL) {
+        uring_free(u);
+        return -1;
+    }
+
+    sq = u->sq_ring;
+    cq = u->cq_ring;
+    u->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    io->uring = u;
+    return 0;
+}
+
+static void uring_read(struct flex_uring *u, int fd, void *buf, size_t len, long offset, uint64_t tag) {
+    unsigned tail = *u->sq_tail;
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    unsigned slot = u->free_slot[--u->nfree];   // flex_io_read() keeps inflight under depth
+
+    u->iov[slot].iov_base = buf;
+    u->iov[slot].iov_len  = len;
+    u->tags[slot] = tag;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = IORING_OP_READV;
+    sqe->fd        = fd;
+    sqe->addr      = (uintptr_t)&u->iov[slot];
+    sqe->len       = 1;
+    sqe->off       = offset;
+    sqe->user_data = slot;
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->pending++;
+}
+
+static int uring_wait(struct flex_uring *u, uint64_t *tag, int *result) {
+    struct io_uring_cqe *cqe;
+    unsigned head;
+    int res;
+
+    for (;;) {
+        head = *u->cq_head;
+        if (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe     = &u->cqes[head & *u->cq_mask];
+            *tag    = u->tags[cqe->user_data];
+            *result = cqe->res;
+            u->free_slot[u->nfree++] = cqe->user_data;
+            __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        // Submit what is queued and wait for something to finish
+        res = syscall(__NR_io_uring_enter, u->fd, u->pending, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        u->pending -= res;
+    }
+}
+#endif
+
+/**
+ * @brief Sets up a read queue.
+ * @param depth Most reads in flight, FLEX_IO_DEPTH is a good default.
+ * @return 0 on success, -1 if out of memory.
+ */
+int flex_io_init(FLEX_IO *io, unsigned depth) {
+    memset(io, 0, sizeof(*io));
+    io->depth = depth ? depth : FLEX_IO_DEPTH;
+#ifdef HAVE_URING
+    if (uring_setup(io) == 0)
+        return 0;
+#endif
+    io->done_tag = malloc(io->depth * sizeof(uint64_t));
+    io->done_res = malloc(io->depth * sizeof(int));
+    if (io->done_tag == NULL || io->done_res == NULL) {
+        flex_io_exit(io);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Frees a read queue. Reads still in flight must be waited for first.
+ */
+void flex_io_exit(FLEX_IO *io) {
+#ifdef HAVE_URING
+    if (io->uring)
+        uring_free(io->uring);
+#endif
+    free(io->done_tag);
+    free(io->done_res);
+    memset(io, 0, sizeof(*io));
+}
+
+/**
+ * @brief Queues a read of len bytes at offset into buf.
+ * @param tag Handed back by flex_io_wait() when the read is done.
+ * @return 0 on success, -1 if depth reads are already in flight.
+ *
+ * The buffer must stay untouched until the read has been waited for.
+ */
+int flex_io_read(FLEX_IO *io, int fd, void *buf, size_t len, long offset, uint64_t tag) {
+    unsigned slot;
+    ssize_t res;
+
+    if (io->inflight == io->depth)
+        return -1;
+#ifdef HAVE_URING
+    if (io->uring) {
+        uring_read(io->uring, fd, buf, len, offset, tag);
+        io->inflight++;
+        return 0;
+    }
+#endif
+    while ((res = pread(fd, buf, len, offset)) < 0 && errno == EINTR)
+        ;
+    slot = (io->done_head + io->inflight) % io->depth;
+    io->done_tag[slot] = tag;
+    io->done_res[slot] = res < 0 ? -errno : res;
+    io->inflight++;
+    return 0;
+}
+
+/**
+ * @brief Waits for a queued read to finish, in any order.
+ * @param tag Set to the tag the read was queued with.
+ * @param result Set to the bytes read, or -errno if the read failed.
+ * @return 0 on success, -1 if nothing is in flight or the queue failed.
+ */
+int flex_io_wait(FLEX_IO *io, uint64_t *tag, int *result) {
+    if (io->inflight == 0)
+        return -1;
+#ifdef HAVE_URING
+    if (io->uring) {
+        if (uring_wait(io->uring, tag, result) < 0)
+            return -1;
+        io->inflight--;
+        return 0;
+    }
+#endif
+    *tag    = io->done_tag[io->done_head];
+    *result = io->done_res[io->done_head];
+    io->done_head = (io->done_head + 1) % io->depth;
+    io->inflight--;
+    return 0;
+}
+
+/*
+ * Chain walker. Each chain has at most one read in flight, since where it
+ * goes next is only known once its last sector is in, so the queue is kept
+ * full by walking many chains (of one image or several) side by side. A
+ * read takes the rest of the chain's expected length, up to FLEX_RUN_MAX
+ * sectors, in case the chain carries on in physical order.
+ */
+struct walk_state {
+    uint8_t   track, sector;    // Next sector to read
+    int       left;             // Sectors expected still, 0 if unknown
+};
+
+/**
+ * @brief Walks a set of chains, keeping the read queue full.
+ * @param io Read queue, empty.
+ * @param chains Chains to walk, from any number of images.
+ * @param n Number of chains.
+ * @param fn Called for each sector of each chain, in chain order.
+ * @param arg Passed to fn.
+ * @return 0 on success, -1 if out of memory or the queue failed.
+ *
+ * The sectors of one chain arrive in order, those of different chains are
+ * interleaved. The data passed to fn is only valid during the call. A chain
+ * that loops is only stopped by fn.
+ */
+int flex_io_walk(FLEX_IO *io, const FLEX_WALK *chains, int n, flex_walk_fn fn, void *arg) {
+    size_t run = FLEX_RUN_MAX * SECTOR_SIZE;
+    struct walk_state *state = calloc(n, sizeof(struct walk_state));
+    int *ready = malloc(n * sizeof(int));
+    int *slot_chain = malloc(io->depth * sizeof(int));
+    int *free_slots = malloc(io->depth * sizeof(int));
+    uint8_t *bufs = malloc(io->depth * run);
+    int ready_head = 0, ready_count = 0;
+    int nfree = io->depth;
+    int ret = -1;
+    unsigned i;
+    int c, k, slot, got, result, stop;
+    long offset, count;
+    uint64_t tag;
+
+    if (state == NULL || ready == NULL || slot_chain == NULL || free_slots == NULL || bufs == NULL)
+        goto out;
+    for (i = 0; i < io->depth; i++)
+        free_slots[i] = i;
+    for (c = 0; c < n; c++) {
+        state[c].track  = chains[c].track;
+        state[c].sector = chains[c].sector;
+        state[c].left   = chains[c].sectors;
+        if (chains[c].track || chains[c].sector)
+            ready[ready_count++] = c;
+    }
+
+    while (ready_count || io->inflight) {
+        // Start a read for every chain that is ready, as far as the queue goes
+        while (ready_count && nfree) {
+            c = ready[ready_head];
+            ready_head = (ready_head + 1) % n;
+            ready_count--;
+            offset = flex_image_offset(chains[c].img, state[c].track, state[c].sector);
+            if (offset < 0) {
+                fn(arg, c, state[c].track, state[c].sector, NULL);
+                continue;
+            }
+            count = (chains[c].img->size - offset) / SECTOR_SIZE;
+            if (count > FLEX_RUN_MAX)
+                count = FLEX_RUN_MAX;
+            if (state[c].left > 0 && count > state[c].left)
+                count = state[c].left;
+            slot = free_slots[--nfree];
+            slot_chain[slot] = c;
+            flex_io_read(io, chains[c].img->fd, bufs + slot * run, count * SECTOR_SIZE, offset, slot);
+        }
+
+        // Chains that linked off the disk may have been all there was
+        if (io->inflight == 0)
+            continue;
+        if (flex_io_wait(io, &tag, &result) < 0) {
+            bufs = NULL;        // Reads may still land there, leave it be
+            goto out;
+        }
+        slot = tag;
+        c = slot_chain[slot];
+        free_slots[nfree++] = slot;
+        got = result / SECTOR_SIZE;
+        if (got <= 0) {
+            fn(arg, c, state[c].track, state[c].sector, NULL);
+            continue;
+        }
+
+        // Hand the sectors out while the chain follows the run
+        for (k = 0; k < got; k++) {
+            const uint8_t *data = bufs + slot * run + k * SECTOR_SIZE;
+            int track = state[c].track, sector = state[c].sector;
+
+            stop = fn(arg, c, track, sector, data);
+            if (state[c].left > 0)
+                state[c].left--;
+            if (stop || (data[0] == 0 && data[1] == 0))
+                break;
+            if (sector == chains[c].img->sectors) {
+                track++;
+                sector = 1;
+            } else
+                sector++;
+            state[c].track  = data[0];
+            state[c].sector = data[1];
+            if (data[0] != track || data[1] != sector || k == got - 1) {
+                // Carry on from the link with a new read
+                ready[(ready_head + ready_count++) % n] = c;
+                break;
+            }
+        }
+    }
+    ret = 0;
+out:
+    free(bufs);
+    free(free_slots);
+    free(slot_chain);
+    free(ready);
+    free(state);
+    return ret;
+}
+
+/*
+ * Gathered output. Binary files are the sector payloads as they are, so
+ * with the image mapped they can go from the page cache to the output file
+ * without passing through a buffer: the slices are queued and written with
+ * writev(), FLEX_IOV_MAX at a time. Slices that follow on from each other
+ * are merged.
+ */
+
+/**
+ * @brief Starts gathering output for a file descriptor.
+ */
+void flex_output_init(FLEX_OUTPUT *o, int fd) {
+    o->fd    = fd;
+    o->count = 0;
+}
+
+/**
+ * @brief Queues a slice, writing the queue out when it is full.
+ * @param buf Data, which must stay valid until the queue is written.
+ * @return 0 on success, -1 on a write error.
+ */
+int flex_output_add(FLEX_OUTPUT *o, const void *buf, size_t len) {
+    struct iovec *last;
+
+    if (o->count) {
+        last = &o->iov[o->count - 1];
+        if ((const uint8_t *)last->iov_base + last->iov_len == buf) {
+            last->iov_len += len;
+            return 0;
+        }
+    }
+    if (o->count == FLEX_IOV_MAX && flex_output_flush(o) < 0)
+        return -1;
+    o->iov[o->count].iov_base = (void *)buf;
+    o->iov[o->count].iov_len  = len;
+    o->count++;
+    return 0;
+}
+
+/**
+ * @brief Writes out the queued slices.
+ * @return 0 on success, -1 on a write error (errno is set).
+ */
+int flex_output_flush(FLEX_OUTPUT *o) {
+    struct iovec *iov = o->iov;
+    int count = o->count;
+    ssize_t got;
+
+    o->count = 0;
+    while (count) {
+        got = writev(o->fd, iov, count);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // Skip what was written, a short write can stop inside a slice
+        while (count && (size_t)got >= iov->iov_len) {
+            got -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count) {
+            iov->iov_base = (uint8_t *)iov->iov_base + got;
+            iov->iov_len -= got;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Geometry probe, for images whose SIR cannot be trusted. The link bytes
+ * of every sector are gathered in one pass, then each tracks x sectors
+ * layout that fits the file size is scored on them: links that land on the
+ * disk at all, and links to the physically next sector (fresh free chains
+ * and most files are laid out that way) which only line up under the
+ * right sectors per track.
+ */
+#define PROBE_CHUNK     64      // Sectors per read when the image is not mapped
+
+// Gather the track and sector link bytes of n sectors
+static int probe_links(const FLEX_IMAGE *img, uint8_t *lt, uint8_t *ls, size_t n) {
+    uint8_t buf[PROBE_CHUNK * SECTOR_SIZE];
+    size_t i, j, count;
+
+    if (img->base) {
+        for (i = 0; i < n; i++) {
+            lt[i] = img->base[i * SECTOR_SIZE];
+            ls[i] = img->base[i * SECTOR_SIZE + 1];
+        }
+        return 0;
+    }
+    for (i = 0; i < n; i += count) {
+        count = n - i < PROBE_CHUNK ? n - i : PROBE_CHUNK;
+        if (pread(img->fd, buf, count * SECTOR_SIZE, i * SECTOR_SIZE) != (ssize_t)(count * SECTOR_SIZE))
+            return -1;
+        for (j = 0; j < count; j++) {
+            lt[i + j] = buf[j * SECTOR_SIZE];
+            ls[i + j] = buf[j * SECTOR_SIZE + 1];
+        }
+    }
+    return 0;
+}
+
+// Score one layout, the loop is branch free over plain byte arrays
+static int probe_score(const uint8_t *lt, const uint8_t *ls, size_t n,
+                       int tracks, int sectors, int sir_match) {
+    size_t linked = 0, valid = 0, next = 0;
+    size_t i;
+
+    // The boot sectors are not linked
+    for (i = 2; i < n; i++) {
+        size_t target = (size_t)lt[i] * sectors + ls[i] - 1;
+        int used = (lt[i] | ls[i]) != 0;
+        int ok = used & (lt[i] < tracks) & (ls[i] >= 1) & (ls[i] <= sectors);
+        linked += used;
+        valid  += ok;
+        next   += ok & (target == i + 1);
+    }
+    if (linked == 0)
+        return sir_match ? 100 : 0;
+    return (30 * valid + 60 * next) / linked + 10 * sir_match;
+}
+
+static int probe_cmp(const void *a, const void *b) {
+    const FLEX_GEOMETRY *ga = a, *gb = b;
+
+    if (ga->confidence != gb->confidence)
+        return gb->confidence - ga->confidence;
+    return ga->sectors - gb->sectors;
+}
+
+/**
+ * @brief Works out the likely geometry of an image from its sector links.
+ * @param img Open image, mapped or FLEX_PREAD.
+ * @param list Filled with the best candidates, most likely first.
+ * @param max Size of list.
+ * @return Number of candidates in list, 0 if no layout fits the file size.
+ *
+ * Every layout of MIN_SECTORS to MAX_SECTORS sectors and up to MAX_TRACKS
+ * tracks whose size matches the file exactly is a candidate. A layout that
+ * matches the SIR gets a little extra confidence.
+ */
+int flex_image_probe(const FLEX_IMAGE *img, FLEX_GEOMETRY *list, int max) {
+    FLEX_GEOMETRY cand[MAX_SECTORS + 1];
+    size_t n = img->size / SECTOR_SIZE;
+    SIR_struct sir;
+    uint8_t *lt, *ls;
+    int ncand = 0;
+    int sectors, tracks;
+
+    if (img->size % SECTOR_SIZE || n < 3)
+        return 0;
+    if (pread(img->fd, &sir, sizeof(sir), 2 * SECTOR_SIZE + SIR_OFFSET) != sizeof(sir))
+        memset(&sir, 0, sizeof(sir));
+
+    lt = malloc(n);
+    ls = malloc(n);
+    if (lt == NULL || ls == NULL || probe_links(img, lt, ls, n) < 0) {
+        free(lt);
+        free(ls);
+        return 0;
+    }
+    for (sectors = MIN_SECTORS; sectors <= MAX_SECTORS; sectors++) {
+        if (n % sectors)
+            continue;
+        tracks = n / sectors;
+        if (tracks > MAX_TRACKS)
+            continue;
+        cand[ncand].tracks     = tracks;
+        cand[ncand].sectors    = sectors;
+        cand[ncand].confidence = probe_score(lt, ls, n, tracks, sectors,
+            sir.endTrack + 1 == tracks && sir.endSector == sectors);
+        ncand++;
+    }
+    free(lt);
+    free(ls);
+
+    qsort(cand, ncand, sizeof(FLEX_GEOMETRY), probe_cmp);
+    if (ncand > max)
+        ncand = max;
+    memcpy(list, cand, ncand * sizeof(FLEX_GEOMETRY));
+    return ncand;
+}
+
+/*
+ * Space compressed text. FLEX text files use 0x0D for newline, 0x09 and a
+ * count for a run of spaces and 0x00 (and 0x18) as padding. Each byte is
+ * classified through a table; runs of plain bytes are found a word at a
+ * time and copied as a block.
+ */
+#define T_COPY  0       // Copy the byte
+#define T_SKIP  1       // Padding, dropped
+#define T_TAB   2       // 0x09, next byte is a space count
+#define T_NL    3       // Newline
+#define T_CR    4       // Newline unless it follows a LF
+#define T_LF    5       // Newline unless it follows a CR
+
+#define C T_COPY
+#define S T_SKIP
+#define T T_TAB
+#define N T_NL
+#define R T_CR
+#define L T_LF
+
+static const uint8_t text_class[2][256] = {
+    {   // flexfs: everything but the FLEX codes is passed through
+    S, C, C, C, C, C, C, C, C, T, C, C, C, N, C, C,
+    C, C, C, C, C, C, C, C, S, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    },
+    {   // FLEX_TEXT_PRINTABLE: printable ASCII only
+    S, S, S, S, S, S, S, S, S, T, L, S, S, R, S, S,
+    S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, C,
+    C, C, C, C, C, C, C, C, C, C, C, C, C, C, C, S,
+    S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+    S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+    S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+    S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+    S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+    S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+    S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+    S, S, S, S, S, S, S, S, S, S, S, S, S, S, S, S,
+    }
+};
+
+#undef C
+#undef S
+#undef T
+#undef N
+#undef R
+#undef L
+
+// Per byte masks for testing 8 bytes at once
+#define ONES    0x0101010101010101ULL
+#define HIGHS   0x8080808080808080ULL
+
+/**
+ * @brief Tests whether any byte of a word may need more than a copy.
+ *
+ * Every byte with a special meaning is below 0x20; in printable mode bytes
+ * from 0x7F up are dropped as well. A hit only sends the word to the table.
+ */
+static int text_special(uint64_t w, int printable) {
+    uint64_t low = (w - ONES * 0x20) & ~w & HIGHS;
+
+    if (printable)
+        return low || (((w + ONES * (0x80 - 0x7F)) | w) & HIGHS);
+    return low != 0;
+}
+
+/**
+ * @brief Sets up a decoder for a new file.
+ * @param t Decoder state.
+ * @param flags 0 or FLEX_TEXT_PRINTABLE.
+ */
+void flex_text_init(FLEX_TEXT *t, int flags) {
+    memset(t, 0, sizeof(*t));
+    t->flags = flags;
+}
+
+/**
+ * @brief Decodes a block of space compressed text.
+ * @param t Decoder state, a 0x09 at the end of one block is finished by the next.
+ * @param in Bytes to decode, usually the 252 data bytes of a sector.
+ * @param len Number of bytes.
+ * @param out Output buffer, at least FLEX_TEXT_MAX(len) bytes.
+ * @return Number of bytes written to out.
+ */
+size_t flex_text_decode(FLEX_TEXT *t, const uint8_t *in, size_t len, uint8_t *out) {
+    int printable = t->flags & FLEX_TEXT_PRINTABLE;
+    const uint8_t *class = text_class[printable ? 1 : 0];
+    uint8_t *p = out;
+    size_t i = 0, start;
+    uint64_t w;
+    uint8_t c;
+
+    while (i < len) {
+        if (t->space) {
+            c = in[i++];
+            memset(p, ' ', c);
+            p += c;
+            t->space = 0;
+            t->last = c;
+            continue;
+        }
+        // Plain run, a word at a time and then a byte at a time
+        start = i;
+        while (i + 8 <= len) {
+            memcpy(&w, in + i, 8);
+            if (text_special(w, printable))
+                break;
+            i += 8;
+        }
+        while (i < len && class[in[i]] == T_COPY)
+            i++;
+        if (i > start) {
+            memcpy(p, in + start, i - start);
+            p += i - start;
+            t->last = in[i - 1];
+        }
+        if (i == len)
+            break;
+
+        c = in[i++];
+        switch (class[c]) {
+        case T_TAB:
+            t->space = 1;
+            break;
+        case T_NL:
+            *p++ = '\n';
+            break;
+        case T_CR:
+            if (t->last != 0x0A)
+                *p++ = '\n';
+            break;
+        case T_LF:
+            if (t->last != 0x0D)
+                *p++ = '\n';
+            break;
+        }
+        t->last = c;
+    }
+    return p - out;
+}
+
+/*
+ * Encoding is the reverse: tabs are expanded to spaces at the tab stops,
+ * runs of spaces are written as 0x09 and a count (at most 127 per marker)
+ * and LF, CR LF and a lone CR all become 0x0D.
+ */
+#define SPACE_RUN_MAX   127
+#define SPACES          (ONES * ' ')
+#define ENC_SPECIAL(c)  ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+/**
+ * @brief Sets up an encoder for a new file.
+ * @param t Encoder state.
+ * @param tabs Tab stop width, clamped to 1-127.
+ */
+void flex_text_encode_init(FLEX_TEXT *t, int tabs) {
+    memset(t, 0, sizeof(*t));
+    if (tabs < 1)
+        tabs = 1;
+    if (tabs > SPACE_RUN_MAX)
+        tabs = SPACE_RUN_MAX;
+    t->tabs = tabs;
+}
+
+// Write out the pending spaces, one on its own is cheaper as a space
+static uint8_t *text_flush_spaces(FLEX_TEXT *t, uint8_t *p) {
+    if (t->spaces == 1)
+        *p++ = ' ';
+    else if (t->spaces) {
+        *p++ = 0x09;
+        *p++ = t->spaces;
+    }
+    t->spaces = 0;
+    return p;
+}
+
+// Add spaces to the pending run, full runs are written straight away
+static uint8_t *text_add_spaces(FLEX_TEXT *t, uint8_t *p, size_t n) {
+    size_t total = t->spaces + n;
+
+    t->column += n;
+    while (total >= SPACE_RUN_MAX) {
+        *p++ = 0x09;
+        *p++ = SPACE_RUN_MAX;
+        total -= SPACE_RUN_MAX;
+    }
+    t->spaces = total;
+    return p;
+}
+
+/**
+ * @brief Encodes a block of host text as FLEX space compressed text.
+ * @param t Encoder state, space runs and CR LF pairs carry over between blocks.
+ * @param in Host text.
+ * @param len Number of bytes.
+ * @param out Output buffer, at least FLEX_TEXT_ENC_MAX(len) bytes.
+ * @return Number of bytes written to out.
+ *
+ * Spaces still pending at the end of the text are written by
+ * flex_text_encode_end().
+ */
+size_t flex_text_encode(FLEX_TEXT *t, const uint8_t *in, size_t len, uint8_t *out) {
+    uint8_t *p = out;
+    size_t i = 0, start;
+    uint64_t w;
+    uint8_t c;
+
+    while (i < len) {
+        // Space runs, a word at a time and then a byte at a time
+        start = i;
+        while (i + 8 <= len) {
+            memcpy(&w, in + i, 8);
+            if (w != SPACES)
+                break;
+            i += 8;
+        }
+        while (i < len && in[i] == ' ')
+            i++;
+        if (i > start) {
+            p = text_add_spaces(t, p, i - start);
+            t->last = ' ';
+            continue;
+        }
+
+        // Plain run, nothing up to and including space needs a look
+        while (i + 8 <= len) {
+            memcpy(&w, in + i, 8);
+            if ((w - ONES * 0x21) & ~w & HIGHS)
+                break;
+            i += 8;
+        }
+        while (i < len && !ENC_SPECIAL(in[i]))
+            i++;
+        if (i > start) {
+            p = text_flush_spaces(t, p);
+            memcpy(p, in + start, i - start);
+            p += i - start;
+            t->column += i - start;
+            t->last = in[i - 1];
+            continue;
+        }
+
+        c = in[i++];
+        switch (c) {
+        case '\t':
+            p = text_add_spaces(t, p, t->tabs - t->column % t->tabs);
+            break;
+        case '\n':
+            if (t->last == '\r')
+                break;          // Second half of CR LF
+            // Fall through
+        case '\r':
+            p = text_flush_spaces(t, p);
+            *p++ = 0x0D;
+            t->column = 0;
+            break;
+        }
+        t->last = c;
+    }
+    return p - out;
+}
+
+/**
+ * @brief Finishes an encoded file.
+ * @param t Encoder state.
+ * @param out Output buffer, at least 2 bytes.
+ * @return Number of bytes written to out.
+ */
+size_t flex_text_encode_end(FLEX_TEXT *t, uint8_t *out) {
+    return text_flush_spaces(t, out) - out;
+}
+
+/**
+ * @brief Parses a search pattern.
+ * @param s Search to fill in, its match list is emptied.
+ * @param text Hex bytes ("41 42 ?? 0d", spaces optional) or, after a double
+ *        quote, ASCII text ("NAME?TXT). '?' is a wildcard in both, a
+ *        backslash makes the next ASCII character literal.
+ * @return 0 on success, -1 if the pattern is empty, too long, badly formed
+ *         or has no fixed byte.
+ */
+int flex_search_parse(FLEX_SEARCH *s, const char *text) {
+    static const char hex[] = "0123456789abcdef";
+    const char *h, *l;
+    size_t n = 0;
+
+    s->len = s->count = 0;
+    while (*text == ' ')
+        text++;
+
+    if (*text == '"') {
+        for (text++; *text && *text != '"'; text++) {
+            if (n == FLEX_SEARCH_MAX)
+                return -1;
+            if (*text == '\\' && text[1])
+                text++;
+            else if (*text == '?') {
+                s->fixed[n++] = 0;
+                continue;
+            }
+            s->byte[n] = *text;
+            s->fixed[n++] = 1;
+        }
+    } else {
+        while (*text) {
+            if (*text == ' ') {
+                text++;
+                continue;
+            }
+            if (n == FLEX_SEARCH_MAX)
+                return -1;
+            if (*text == '?') {
+                // "?" and "??" are both one wildcard byte
+                text += text[1] == '?' ? 2 : 1;
+                s->fixed[n++] = 0;
+                continue;
+            }
+            if (!(h = strchr(hex, tolower((unsigned char)text[0]))) ||
+                !text[1] || !(l = strchr(hex, tolower((unsigned char)text[1]))))
+                return -1;
+            s->byte[n] = (h - hex) << 4 | (l - hex);
+            s->fixed[n++] = 1;
+            text += 2;
+        }
+    }
+
+    // Find candidates by a fixed byte, preferring one that is not filler
+    s->anchor = n;
+    for (size_t i = 0; i < n; i++) {
+        if (!s->fixed[i])
+            continue;
+        if (s->anchor == n)
+            s->anchor = i;
+        if (s->byte[i] != 0x00 && s->byte[i] != 0x20 && s->byte[i] != 0xFF) {
+            s->anchor = i;
+            break;
+        }
+    }
+    if (s->anchor == n)
+        return -1;
+    s->len = n;
+    return 0;
+}
+
+/**
+ * @brief Finds every match of a parsed pattern, overlapping ones included.
+ * @param s Parsed search, its match list is replaced.
+ * @param base Image, usually the mapping.
+ * @param size Image size.
+ * @return Number of matches, -1 if out of memory.
+ *
+ * Candidates come from memchr() on the anchor byte, which the C library
+ * scans a vector at a time, and only those are compared in full.
+ */
+long flex_search_run(FLEX_SEARCH *s, const uint8_t *base, size_t size) {
+    const uint8_t *p, *end;
+    size_t start, i;
+
+    s->count = 0;
+    if (s->len == 0 || size < s->len)
+        return 0;
+
+    // Anchor positions that leave room for the whole pattern
+    p = base + s->anchor;
+    end = base + size - s->len + s->anchor + 1;
+    while (p < end && (p = memchr(p, s->byte[s->anchor], end - p)) != NULL) {
+        start = p - base - s->anchor;
+        for (i = 0; i < s->len; i++) {
+            if (s->fixed[i] && base[start + i] != s->byte[i])
+                break;
+        }
+        if (i == s->len) {
+            if (s->count == s->cap) {
+                size_t cap = s->cap ? s->cap * 2 : 256;
+                size_t *m = realloc(s->match, cap * sizeof(*m));
+                if (m == NULL)
+                    return -1;
+                s->match = m;
+                s->cap = cap;
+            }
+            s->match[s->count++] = start;
+        }
+        p++;
+    }
+    return s->count;
+}
+
+/**
+ * @brief Finds the first match at or after an offset.
+ * @return Index into s->match, s->count if there is none.
+ */
+size_t flex_search_find(const FLEX_SEARCH *s, size_t offset) {
+    size_t lo = 0, hi = s->count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (s->match[mid] < offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief Finds the match to show from an offset, wrapping around the image.
+ * @param s Search with at least one match.
+ * @param offset Usually the current sector or match.
+ * @param dir 0 for the first match at or after offset, 1 for the first one
+ *        after it, -1 for the last one before it.
+ * @return Index into s->match.
+ */
+size_t flex_search_seek(const FLEX_SEARCH *s, size_t offset, int dir) {
+    size_t i = flex_search_find(s, dir > 0 ? offset + 1 : offset);
+
+    if (dir < 0)
+        return (i + s->count - 1) % s->count;
+    return i == s->count ? 0 : i;
+}
+
+/**
+ * @brief Frees the match list of a search.
+ */
+void flex_search_free(FLEX_SEARCH *s) {
+    free(s->match);
+    s->match = NULL;
+    s->count = s->cap = s->len = 0;
+}
+
+/**
+ * @brief Returns the index of the sector a link points to, -1 if none.
+ */
+static long index_link(const FLEX_IMAGE *img, const uint8_t *link) {
+    long offset;
+
+    if (link[0] == 0 && link[1] == 0)
+        return -1;
+    offset = flex_image_offset(img, link[0], link[1]);
+    return offset < 0 ? -1 : offset / SECTOR_SIZE;
+}
+
+/**
+ * @brief Marks the sectors of a chain with their owner, stopping at the
+ * first sector that already has one. Along the chain the predecessor is
+ * the chain's own, whatever else links there.
+ */
+static void index_chain(FLEX_INDEX *x, const FLEX_IMAGE *img, int32_t owner, int track, int sector) {
+    long offset = flex_image_offset(img, track, sector);
+    long cur = offset < 0 ? -1 : offset / SECTOR_SIZE;
+    long next;
+
+    while (cur >= 0 && x->owner[cur] == FLEX_OWNER_NONE) {
+        x->owner[cur] = owner;
+        next = index_link(img, img->base + cur * SECTOR_SIZE);
+        if (next >= 0)
+            x->prev[next] = cur;
+        cur = next;
+    }
+}
+
+/**
+ * @brief Builds the owner and predecessor index of a mapped image.
+ * @param x Index to fill in.
+ * @param img Mapped image, with its geometry set.
+ * @return 0 on success, -1 if out of memory.
+ *
+ * Every sector's link bytes are scanned once for predecessors. Then the
+ * system sectors, directory, free chain and each file are walked to give
+ * the sectors their owners.
+ */
+int flex_index_build(FLEX_INDEX *x, const FLEX_IMAGE *img) {
+    const SIR_struct *sir;
+    const DIR_struct *d;
+    long i, next, dir;
+    int cap = 0;
+
+    memset(x, 0, sizeof(*x));
+    x->count = img->size / SECTOR_SIZE;
+    if (x->count == 0)
+        return 0;
+    x->prev = malloc(x->count * sizeof(*x->prev));
+    x->owner = malloc(x->count * sizeof(*x->owner));
+    if (x->prev == NULL || x->owner == NULL) {
+        flex_index_free(x);
+        return -1;
+    }
+
+    for (i = 0; i < x->count; i++)
+        x->prev[i] = FLEX_PREV_NONE;
+    for (i = 0; i < x->count; i++) {
+        x->owner[i] = FLEX_OWNER_NONE;
+        if ((next = index_link(img, img->base + i * SECTOR_SIZE)) < 0)
+            continue;
+        if (x->prev[next] == FLEX_PREV_NONE)
+            x->prev[next] = i;
+        else
+            x->prev[next] = FLEX_PREV_MANY;
+    }
+
+    for (i = 0; i < 4 && i < x->count; i++)
+        x->owner[i] = FLEX_OWNER_SYSTEM;
+    index_chain(x, img, FLEX_OWNER_DIR, DIR_START_TRACK, DIR_START_SECTOR);
+    if ((sir = flex_image_sir(img)) != NULL)
+        index_chain(x, img, FLEX_OWNER_FREE, sir->firstFreeTrack, sir->firstFreeSector);
+
+    // Files, in directory order
+    for (dir = 0; dir < x->count; dir++) {
+        if (x->owner[dir] != FLEX_OWNER_DIR)
+            continue;
+        for (d = (const DIR_struct *)(img->base + dir * SECTOR_SIZE + 16);
+             (const uint8_t *)d < img->base + (dir + 1) * SECTOR_SIZE; d++) {
+            struct flex_index_file *f;
+            int n = 0;
+
+            if (d->fileName[0] == 0 || (d->fileName[0] & 0x80))
+                continue;
+            if (x->nfiles == cap) {
+                cap = cap ? cap * 2 : 64;
+                if ((f = realloc(x->files, cap * sizeof(*f))) == NULL) {
+                    flex_index_free(x);
+                    return -1;
+                }
+                x->files = f;
+            }
+            f = &x->files[x->nfiles];
+            for (int k = 0; k < 8 && d->fileName[k] > ' '; k++)
+                f->name[n++] = d->fileName[k];
+            f->name[n++] = '.';
+            for (int k = 0; k < 3 && d->fileExt[k] > ' '; k++)
+                f->name[n++] = d->fileExt[k];
+            f->name[n] = '\0';
+            f->track = d->startTrack;
+            f->sector = d->startSector;
+            index_chain(x, img, x->nfiles++, d->startTrack, d->startSector);
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Frees a sector index.
+ */
+void flex_index_free(FLEX_INDEX *x) {
+    free(x->prev);
+    free(x->owner);
+    free(x->files);
+    x->prev = x->owner = NULL;
+    x->files = NULL;
+    x->count = x->nfiles = 0;
+}
+
+/**
+ * @brief Names the owner of the sector at offset: a file, or what else
+ * the sector is used for. "?" if there is no index or no such sector.
+ */
+const char *flex_index_owner(const FLEX_INDEX *x, long offset) {
+    long block = offset / SECTOR_SIZE;
+
+    if (x == NULL || offset < 0 || block >= x->count)
+        return "?";
+    switch (x->owner[block]) {
+    case FLEX_OWNER_NONE:   return "none";
+    case FLEX_OWNER_FREE:   return "free";
+    case FLEX_OWNER_DIR:    return "directory";
+    case FLEX_OWNER_SYSTEM: return "system";
+    }
+    return x->files[x->owner[block]].name;
+}
+
+/**
+ * @brief Follows the link of the sector at offset forward (dir 1) or goes
+ * back to the one sector that links to it (dir -1).
+ * @param x Index, only needed going back.
+ * @return Offset of that sector, -1 if there is none.
+ */
+long flex_index_step(const FLEX_INDEX *x, const FLEX_IMAGE *img, long offset, int dir) {
+    long block = offset / SECTOR_SIZE;
+
+    if (offset < 0 || (size_t)offset >= img->size)
+        return -1;
+    if (dir > 0)
+        block = index_link(img, img->base + offset);
+    else if (x && block < x->count && x->prev[block] >= 0)
+        block = x->prev[block];
+    else
+        block = -1;
+    return block < 0 ? -1 : block * SECTOR_SIZE;
+}
+
+/**
+ * @brief Finds the first sector of the chain the sector at offset is on:
+ * its file's start, the directory start or the SIR's first free sector.
+ * @return Offset of that sector, -1 if the sector is in no walked chain.
+ */
+long flex_index_start(const FLEX_INDEX *x, const FLEX_IMAGE *img, long offset) {
+    const SIR_struct *sir;
+    long block = offset / SECTOR_SIZE;
+    int32_t owner;
+
+    if (x == NULL || offset < 0 || block >= x->count)
+        return -1;
+    owner = x->owner[block];
+    if (owner >= 0)
+        return flex_image_offset(img, x->files[owner].track, x->files[owner].sector);
+    if (owner == FLEX_OWNER_DIR)
+        return flex_image_offset(img, DIR_START_TRACK, DIR_START_SECTOR);
+    if (owner == FLEX_OWNER_FREE && (sir = flex_image_sir(img)) != NULL)
+        return flex_image_offset(img, sir->firstFreeTrack, sir->firstFreeSector);
+    return -1;
+}